@@ -0,0 +1,93 @@
+#if defined(_MSC_VER) || defined(__STDC_LIB_EXT1__)
+#define _CRT_SECURE_NO_WARNINGS
+#pragma warning(disable: 4996)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "object.h"
+#include "diagnostics.h"
+#include "cache.h"
+
+// Bump when the assembler produces different output for the same source
+#define CACHE_VERSION 1
+
+static char* cache_entry_path(const char* directory, const char* source, size_t size, bool relocatable, const ParseOptions* options);
+static bool load_entry(const char* path, const char* source, const ParseOptions* options, ObjectFile* object);
+
+bool assemble_cached(const char* directory, const char* source, size_t size, const char* filename, bool relocatable, const ParseOptions* options, ObjectFile* object) {
+    if (directory == NULL) {
+        return assemble_object(source, filename, relocatable, options, object);
+    }
+
+    char* path = cache_entry_path(directory, source, size, relocatable, options);
+
+    // The memory map is printed while parsing, so it needs a real assembly
+    if (!options->print_map && load_entry(path, source, options, object)) {
+        // The entry may have been stored for a copy of the source under another name
+        free(object->source_name);
+        object->source_name = malloc(strlen(filename) + 1);
+        strcpy(object->source_name, filename);
+        free(path);
+
+        // Report what the assembly did, nothing had to be searched this time
+        object->stats.windows_searched = 0;
+        print_optimization_stats(filename, options, &object->stats);
+        return true;
+    }
+
+    // Diagnostics are not stored, a source with warnings is assembled again next time
+    // so they are reported again
+    int warnings = warning_count();
+    bool success = assemble_object(source, filename, relocatable, options, object);
+    if (success && warning_count() == warnings && make_directory(directory)) {
+        uint8_t* data;
+        size_t data_size;
+        serialize_object(object, &data, &data_size);
+        // A failed store only costs the next build a reassembly
+        write_file_atomic(path, data, data_size);
+        free(data);
+    }
+
+    free(path);
+    return success;
+}
+
+static char* cache_entry_path(const char* directory, const char* source, size_t size, bool relocatable, const ParseOptions* options) {
+    unsigned long long hash = hash_bytes64(source, size);
+
+    // The rewrite table is not part of the key: the superoptimizer finds the same
+    // rewrite for a window with or without it, the table only saves the search
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%d.%d-%d%s%s%s.o", hash, OBJECT_VERSION, CACHE_VERSION, (int)options->target, relocatable ? "r" : "", options->dedup ? "d" : "", options->superopt_table != NULL ? "s" : "");
+
+    size_t length = strlen(directory);
+    char* path = malloc(length + 1 + strlen(name) + 1);
+    strcpy(path, directory);
+    if (length > 0 && directory[length - 1] != '/' && directory[length - 1] != '\\') {
+        strcat(path, "/");
+    }
+    strcat(path, name);
+    return path;
+}
+
+static bool load_entry(const char* path, const char* source, const ParseOptions* options, ObjectFile* object) {
+    size_t size;
+    const void* data = map_file(path, &size);
+    if (data == NULL) {
+        return false;
+    }
+
+    bool success = deserialize_object(data, size, path, object);
+    unmap_file(data, size);
+
+    // Guard against a hash collision or a damaged entry
+    if (success && !object_matches(object, source, options)) {
+        free_object(object);
+        success = false;
+    }
+    return success;
+}
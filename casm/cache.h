@@ -0,0 +1,21 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "parser.h"
+#include "object.h"
+
+/*
+* Object cache: a directory holding the serialized object of every source assembled
+* with it. Entries are named after a 64-bit content hash of the source, the cache and
+* object format versions, the target, the relocatable flag and the optimizations, so
+* a hit can be mapped and used without tokenizing or parsing the source.
+*/
+
+// Returns the cached object for source if there is one, otherwise assembles it and
+// stores the result. directory may be NULL to bypass the cache.
+bool assemble_cached(const char* directory, const char* source, size_t size, const char* filename, bool relocatable, const ParseOptions* options, ObjectFile* object);
+
+#endif // !CACHE_H
@@ -0,0 +1,379 @@
+#if defined(_MSC_VER) || defined(__STDC_LIB_EXT1__)
+#define _CRT_SECURE_NO_WARNINGS
+#pragma warning(disable: 4996)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "object.h"
+#include "debuginfo.h"
+#include "diagnostics.h"
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+typedef struct {
+    int address;
+    int file;
+    uint32_t line;
+} DebugRow;
+
+typedef struct {
+    int address;
+    int file;
+    uint32_t name;
+} DebugSymbol;
+
+static void add_row(DebugRow** rows, int* count, int* capacity, int address, int file, uint32_t line);
+static int compare_symbol_address(const void* a, const void* b);
+static void init_buffer(ByteBuffer* buffer);
+static void put_bytes(ByteBuffer* buffer, const void* data, size_t size);
+static void put_u16(ByteBuffer* buffer, uint16_t value);
+static void put_u32(ByteBuffer* buffer, uint32_t value);
+static void put_varint(ByteBuffer* buffer, uint32_t value);
+static uint32_t put_string(ByteBuffer* buffer, const char* str);
+static void patch_u32(ByteBuffer* buffer, size_t position, uint32_t value);
+static uint16_t read_u16(const uint8_t* data);
+static uint32_t read_u32(const uint8_t* data);
+static uint32_t read_varint(const uint8_t** cursor, const uint8_t* end);
+
+bool write_debug_info(const char* path, const ObjectFile* objects, const int* bases, int object_count) {
+    ByteBuffer strings;
+    init_buffer(&strings);
+
+    // Merge the line tables in address order, the objects are laid out back to back
+    int row_count = 0;
+    int row_capacity = 64;
+    DebugRow* rows = malloc(row_capacity * sizeof(DebugRow));
+    uint32_t* files = malloc((object_count > 0 ? object_count : 1) * sizeof(uint32_t));
+    for (int i = 0; i < object_count; i++) {
+        const ObjectFile* object = &objects[i];
+        files[i] = put_string(&strings, object->source_name != NULL ? object->source_name : "");
+        for (int j = 0; j < object->line_count; j++) {
+            add_row(&rows, &row_count, &row_capacity, bases[i] + object->lines[j].offset, i, object->lines[j].line);
+        }
+        add_row(&rows, &row_count, &row_capacity, bases[i] + object->code_size, i, 0);
+    }
+
+    int symbol_count = 0;
+    for (int i = 0; i < object_count; i++) {
+        symbol_count += objects[i].export_count + objects[i].local_count;
+    }
+    DebugSymbol* symbols = malloc((symbol_count > 0 ? symbol_count : 1) * sizeof(DebugSymbol));
+    symbol_count = 0;
+    for (int i = 0; i < object_count; i++) {
+        const ObjectFile* object = &objects[i];
+        for (int j = 0; j < object->export_count + object->local_count; j++) {
+            const ObjectSymbol* label = j < object->export_count ? &object->exports[j] : &object->locals[j - object->export_count];
+            DebugSymbol* symbol = &symbols[symbol_count++];
+            symbol->address = label->address - object->origin + bases[i];
+            symbol->file = i;
+            symbol->name = put_string(&strings, label->name);
+        }
+    }
+    qsort(symbols, symbol_count, sizeof(DebugSymbol), compare_symbol_address);
+
+    // Blocks and their delta encoded rows
+    ByteBuffer blocks;
+    ByteBuffer encoded;
+    init_buffer(&blocks);
+    init_buffer(&encoded);
+    int block_count = 0;
+    for (int i = 0; i < row_count; i++) {
+        if (i % DEBUG_BLOCK_ROWS == 0) {
+            put_u16(&blocks, (uint16_t)rows[i].address);
+            put_u16(&blocks, (uint16_t)rows[i].file);
+            put_u32(&blocks, rows[i].line);
+            put_u32(&blocks, (uint32_t)encoded.size);
+            block_count++;
+            continue;
+        }
+
+        bool file_changed = rows[i].file != rows[i - 1].file;
+        int32_t line_delta = (int32_t)(rows[i].line - rows[i - 1].line);
+        put_varint(&encoded, ((uint32_t)(rows[i].address - rows[i - 1].address) << 1) | file_changed);
+        if (file_changed) {
+            put_varint(&encoded, (uint32_t)rows[i].file);
+        }
+        put_varint(&encoded, ((uint32_t)line_delta << 1) ^ (uint32_t)(line_delta >> 31));
+    }
+
+    ByteBuffer output;
+    init_buffer(&output);
+    put_bytes(&output, DEBUG_MAGIC, 4);
+    put_u16(&output, DEBUG_VERSION);
+    put_u16(&output, (uint16_t)object_count);
+    put_u32(&output, (uint32_t)row_count);
+    put_u32(&output, (uint32_t)block_count);
+    put_u32(&output, (uint32_t)symbol_count);
+    for (int i = 0; i < 5; i++) {
+        put_u32(&output, 0);
+    }
+
+    // Tables of 4 byte fields go first so they stay aligned
+    patch_u32(&output, 20, (uint32_t)output.size);
+    for (int i = 0; i < object_count; i++) {
+        put_u32(&output, files[i]);
+    }
+    patch_u32(&output, 24, (uint32_t)output.size);
+    put_bytes(&output, blocks.data, blocks.size);
+    patch_u32(&output, 32, (uint32_t)output.size);
+    for (int i = 0; i < symbol_count; i++) {
+        put_u16(&output, (uint16_t)symbols[i].address);
+        put_u16(&output, (uint16_t)symbols[i].file);
+        put_u32(&output, symbols[i].name);
+    }
+    patch_u32(&output, 28, (uint32_t)output.size);
+    put_bytes(&output, encoded.data, encoded.size);
+    patch_u32(&output, 36, (uint32_t)output.size);
+    put_bytes(&output, strings.data, strings.size);
+
+    bool success = write_file_atomic(path, output.data, output.size);
+    if (!success) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "could not write '%s'", path);
+    }
+
+    free(output.data);
+    free(encoded.data);
+    free(blocks.data);
+    free(strings.data);
+    free(symbols);
+    free(files);
+    free(rows);
+    return success;
+}
+
+bool open_debug_info(const void* data, size_t size, DebugInfo* info) {
+    const uint8_t* bytes = data;
+    if (size < DEBUG_HEADER_SIZE || memcmp(bytes, DEBUG_MAGIC, 4) != 0 || read_u16(bytes + 4) != DEBUG_VERSION) {
+        return false;
+    }
+
+    uint32_t files = read_u32(bytes + 20);
+    uint32_t blocks = read_u32(bytes + 24);
+    uint32_t rows = read_u32(bytes + 28);
+    uint32_t symbols = read_u32(bytes + 32);
+    uint32_t strings = read_u32(bytes + 36);
+
+    info->data = bytes;
+    info->size = size;
+    info->file_count = read_u16(bytes + 6);
+    info->block_count = (int)read_u32(bytes + 12);
+    info->symbol_count = (int)read_u32(bytes + 16);
+
+    // Everything a lookup may touch must lie inside the file
+    if (files > size || (size - files) / 4 < (size_t)info->file_count ||
+        blocks > size || (size - blocks) / 12 < (size_t)info->block_count ||
+        symbols > size || (size - symbols) / 8 < (size_t)info->symbol_count ||
+        rows > size || strings > size || strings == size || bytes[size - 1] != '\0') {
+        return false;
+    }
+
+    info->files = bytes + files;
+    info->blocks = bytes + blocks;
+    info->rows = bytes + rows;
+    info->symbols = bytes + symbols;
+    info->strings = (const char*)bytes + strings;
+    info->strings_size = size - strings;
+
+    for (int i = 0; i < info->file_count; i++) {
+        if (read_u32(info->files + i * 4) >= info->strings_size) {
+            return false;
+        }
+    }
+    for (int i = 0; i < info->symbol_count; i++) {
+        if (read_u32(info->symbols + i * 8 + 4) >= info->strings_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool lookup_line(const DebugInfo* info, int address, const char** file, int* line) {
+    // Last block starting at or below address
+    int low = 0;
+    int high = info->block_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (read_u16(info->blocks + middle * 12) <= address) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return false;
+    }
+
+    const uint8_t* block = info->blocks + (low - 1) * 12;
+    int row_address = read_u16(block);
+    int row_file = read_u16(block + 2);
+    uint32_t row_line = read_u32(block + 4);
+
+    // The rows of a block end where the next block's rows begin
+    const uint8_t* cursor = info->rows + read_u32(block + 8);
+    const uint8_t* end = low < info->block_count ? info->rows + read_u32(block + 20) : (const uint8_t*)info->strings;
+    if (cursor > end || end > info->data + info->size) {
+        return false;
+    }
+
+    while (cursor < end) {
+        uint32_t head = read_varint(&cursor, end);
+        int next_address = row_address + (int)(head >> 1);
+        if (next_address > address) {
+            break;
+        }
+
+        row_address = next_address;
+        if (head & 1) {
+            row_file = (int)read_varint(&cursor, end);
+        }
+        uint32_t zigzag = read_varint(&cursor, end);
+        row_line += (zigzag >> 1) ^ (0u - (zigzag & 1));
+    }
+
+    if (row_line == 0 || row_file >= info->file_count) {
+        return false;
+    }
+    *file = info->strings + read_u32(info->files + row_file * 4);
+    *line = (int)row_line;
+    return true;
+}
+
+const char* lookup_symbol(const DebugInfo* info, int address, int* symbol_address) {
+    int low = 0;
+    int high = info->symbol_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (read_u16(info->symbols + middle * 8) <= address) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+
+    const uint8_t* symbol = info->symbols + (low - 1) * 8;
+    *symbol_address = read_u16(symbol);
+    return info->strings + read_u32(symbol + 4);
+}
+
+// Rows at the same address replace each other, rows that do not change the line are
+// dropped. Addresses past the 16-bit address space cannot be looked up.
+static void add_row(DebugRow** rows, int* count, int* capacity, int address, int file, uint32_t line) {
+    if (address > 0xFFFF) {
+        return;
+    }
+    if (*count > 0 && (*rows)[*count - 1].address == address) {
+        (*count)--;
+    }
+    if (*count > 0 && (*rows)[*count - 1].file == file && (*rows)[*count - 1].line == line) {
+        return;
+    }
+
+    if (*count >= *capacity) {
+        *capacity *= 2;
+        *rows = realloc(*rows, *capacity * sizeof(DebugRow));
+    }
+    (*rows)[*count].address = address;
+    (*rows)[*count].file = file;
+    (*rows)[*count].line = line;
+    (*count)++;
+}
+
+static int compare_symbol_address(const void* a, const void* b) {
+    const DebugSymbol* left = a;
+    const DebugSymbol* right = b;
+    if (left->address != right->address) {
+        return left->address - right->address;
+    }
+    return left->file - right->file;
+}
+
+/*********************************************************************************
+* Byte encoding
+*********************************************************************************/
+
+static void init_buffer(ByteBuffer* buffer) {
+    buffer->capacity = 256;
+    buffer->size = 0;
+    buffer->data = malloc(buffer->capacity);
+}
+
+static void put_bytes(ByteBuffer* buffer, const void* data, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        while (buffer->size + size > buffer->capacity) {
+            buffer->capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void put_u16(ByteBuffer* buffer, uint16_t value) {
+    uint8_t bytes[2] = { value & 0xFF, value >> 8 };
+    put_bytes(buffer, bytes, 2);
+}
+
+static void put_u32(ByteBuffer* buffer, uint32_t value) {
+    uint8_t bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24 };
+    put_bytes(buffer, bytes, 4);
+}
+
+// 7 bits per byte, the high bit is set on all but the last byte
+static void put_varint(ByteBuffer* buffer, uint32_t value) {
+    uint8_t bytes[5];
+    int length = 0;
+    while (value >= 0x80) {
+        bytes[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[length++] = (uint8_t)value;
+    put_bytes(buffer, bytes, length);
+}
+
+static uint32_t put_string(ByteBuffer* buffer, const char* str) {
+    uint32_t offset = (uint32_t)buffer->size;
+    put_bytes(buffer, str, strlen(str) + 1);
+    return offset;
+}
+
+static void patch_u32(ByteBuffer* buffer, size_t position, uint32_t value) {
+    buffer->data[position] = value & 0xFF;
+    buffer->data[position + 1] = (value >> 8) & 0xFF;
+    buffer->data[position + 2] = (value >> 16) & 0xFF;
+    buffer->data[position + 3] = value >> 24;
+}
+
+static uint16_t read_u16(const uint8_t* data) {
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+static uint32_t read_u32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint32_t read_varint(const uint8_t** cursor, const uint8_t* end) {
+    uint32_t value = 0;
+    int shift = 0;
+    while (*cursor < end && shift < 32) {
+        uint8_t byte = *(*cursor)++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    return value;
+}
@@ -0,0 +1,67 @@
+#ifndef DEBUGINFO_H
+#define DEBUGINFO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+
+/*
+* Debug info file (written next to the ROM by 'casm -g'), all integers little endian.
+* It is meant to be mapped and queried in place:
+*
+*   char[4]  magic "CDBG"
+*   u16      version
+*   u16      file count
+*   u32      row count         address -> (file, line) rows
+*   u32      block count
+*   u32      symbol count
+*   u32      files offset      u32 string offset per file
+*   u32      blocks offset     block: u16 address, u16 file, u32 line, u32 rows offset
+*   u32      rows offset       delta encoded rows, see below
+*   u32      symbols offset    symbol: u16 address, u16 file, u32 string offset, sorted by address
+*   u32      strings offset    null terminated strings
+*
+* Rows are sorted by address and each covers the ROM up to the next row; line 0 marks
+* bytes without a source line. Every DEBUG_BLOCK_ROWS rows start a block that holds
+* its first row in full, the remaining rows of the block are stored after the rows
+* offset as varints: (address delta << 1 | file changed), the file if it changed and
+* the zigzag encoded line delta. A lookup binary searches the blocks and decodes at
+* most DEBUG_BLOCK_ROWS - 1 rows.
+*/
+
+#define DEBUG_MAGIC "CDBG"
+#define DEBUG_VERSION 1
+#define DEBUG_HEADER_SIZE 40
+#define DEBUG_BLOCK_ROWS 16
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    int file_count;
+    int block_count;
+    int symbol_count;
+    const uint8_t* files;
+    const uint8_t* blocks;
+    const uint8_t* rows;
+    const uint8_t* symbols;
+    const char* strings;
+    size_t strings_size;
+} DebugInfo;
+
+// Writes the line tables and labels of the objects, placed at bases as the linker
+// laid them out.
+bool write_debug_info(const char* path, const ObjectFile* objects, const int* bases, int object_count);
+
+// Checks the header of a debug info file in memory. The data must outlive info.
+bool open_debug_info(const void* data, size_t size, DebugInfo* info);
+
+// Finds the source line of the byte at address. Returns false if it has none.
+bool lookup_line(const DebugInfo* info, int address, const char** file, int* line);
+
+// Finds the closest label at or below address. Returns its name, or NULL if there is
+// no label before address.
+const char* lookup_symbol(const DebugInfo* info, int address, int* symbol_address);
+
+#endif // !DEBUGINFO_H
@@ -0,0 +1,233 @@
+#if defined(_MSC_VER) || defined(__STDC_LIB_EXT1__)
+#define _CRT_SECURE_NO_WARNINGS
+#pragma warning(disable: 4996)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diagnostics.h"
+
+#define DEFAULT_MAX_ERRORS 100
+
+typedef struct {
+    Severity severity;
+    DiagnosticCode code;
+    int file;           // offset of the file name in text, -1 if none
+    int line;
+    int column;
+    int message;        // offset of the message in text
+} Diagnostic;
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} TextBuffer;
+
+static const char* severity_names[] = { "error", "warning", "note" };
+static const char* code_names[] = {
+    "syntax",
+    "unknown-instruction",
+    "invalid-register",
+    "undefined-symbol",
+    "duplicate-symbol",
+    "out-of-range",
+    "target",
+    "layout",
+    "not-relocatable",
+    "link",
+    "io",
+    "error-limit",
+    "optimization",
+};
+
+static DiagnosticsFormat format = DIAGNOSTICS_TEXT;
+static int max_errors = DEFAULT_MAX_ERRORS;
+static int errors = 0;
+static int warnings = 0;
+
+static Diagnostic* diagnostics = NULL;
+static int diagnostics_count = 0;
+static int diagnostics_capacity = 0;
+static TextBuffer text = { NULL, 0, 0 };   // file names and messages of the diagnostics
+
+static int add_text(TextBuffer* buffer, const char* str, size_t length);
+static void append(TextBuffer* buffer, const char* str);
+static void append_json_string(TextBuffer* buffer, const char* str);
+
+void configure_diagnostics(DiagnosticsFormat diagnostics_format, int error_limit) {
+    format = diagnostics_format;
+    max_errors = error_limit;
+}
+
+void report(Severity severity, DiagnosticCode code, const char* file, int line, int column, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    report_va(severity, code, file, line, column, fmt, args);
+    va_end(args);
+}
+
+void report_va(Severity severity, DiagnosticCode code, const char* file, int line, int column, const char* fmt, va_list args) {
+    if (error_limit_reached()) {
+        return;
+    }
+    if (severity == SEVERITY_ERROR) {
+        errors++;
+    }
+    else if (severity == SEVERITY_WARNING) {
+        warnings++;
+    }
+
+    char message[512];
+    vsnprintf(message, sizeof(message), fmt, args);
+    size_t length = strlen(message);
+    while (length > 0 && message[length - 1] == '\n') {
+        length--;
+    }
+
+    if (diagnostics_count >= diagnostics_capacity) {
+        diagnostics_capacity = diagnostics_capacity == 0 ? 64 : diagnostics_capacity * 2;
+        diagnostics = realloc(diagnostics, diagnostics_capacity * sizeof(Diagnostic));
+    }
+    Diagnostic* diagnostic = &diagnostics[diagnostics_count++];
+    diagnostic->severity = severity;
+    diagnostic->code = code;
+    diagnostic->file = file != NULL ? add_text(&text, file, strlen(file)) : -1;
+    diagnostic->line = line;
+    diagnostic->column = column;
+    diagnostic->message = add_text(&text, message, length);
+
+    if (error_limit_reached()) {
+        errors--; // The note does not count
+        report(SEVERITY_NOTE, DIAGNOSTIC_ERROR_LIMIT, NULL, 0, 0, "too many errors (limit %d), stopping", max_errors);
+        errors++;
+    }
+}
+
+int error_count(void) {
+    return errors;
+}
+
+int warning_count(void) {
+    return warnings;
+}
+
+bool error_limit_reached(void) {
+    return max_errors > 0 && errors >= max_errors;
+}
+
+void flush_diagnostics(void) {
+    if (diagnostics_count == 0 && format == DIAGNOSTICS_TEXT) {
+        errors = 0;
+        warnings = 0;
+        return;
+    }
+
+    TextBuffer output = { NULL, 0, 0 };
+    if (format == DIAGNOSTICS_JSON) {
+        append(&output, "[");
+    }
+
+    for (int i = 0; i < diagnostics_count; i++) {
+        Diagnostic* diagnostic = &diagnostics[i];
+        const char* file = diagnostic->file != -1 ? text.data + diagnostic->file : NULL;
+        const char* message = text.data + diagnostic->message;
+        char number[32];
+
+        if (format == DIAGNOSTICS_JSON) {
+            append(&output, i == 0 ? "{\"severity\":\"" : ",{\"severity\":\"");
+            append(&output, severity_names[diagnostic->severity]);
+            append(&output, "\",\"code\":\"");
+            append(&output, code_names[diagnostic->code]);
+            append(&output, "\",\"file\":");
+            if (file != NULL) {
+                append_json_string(&output, file);
+            }
+            else {
+                append(&output, "null");
+            }
+            snprintf(number, sizeof(number), ",\"line\":%d,\"column\":%d", diagnostic->line, diagnostic->column);
+            append(&output, number);
+            append(&output, ",\"message\":");
+            append_json_string(&output, message);
+            append(&output, "}");
+        }
+        else {
+            if (file != NULL) {
+                append(&output, file);
+                if (diagnostic->line > 0) {
+                    snprintf(number, sizeof(number), ":%d:%d", diagnostic->line, diagnostic->column);
+                    append(&output, number);
+                }
+                append(&output, ": ");
+            }
+            append(&output, severity_names[diagnostic->severity]);
+            append(&output, ": ");
+            append(&output, message);
+            append(&output, " [");
+            append(&output, code_names[diagnostic->code]);
+            append(&output, "]\n");
+        }
+    }
+
+    if (format == DIAGNOSTICS_JSON) {
+        append(&output, "]\n");
+        fwrite(output.data, 1, output.size, stderr);
+        fflush(stderr);
+    }
+    else {
+        fwrite(output.data, 1, output.size, stdout);
+        fflush(stdout);
+    }
+
+    free(output.data);
+    diagnostics_count = 0;
+    text.size = 0;
+    errors = 0;
+    warnings = 0;
+}
+
+// Returns the offset of the null terminated copy of str
+static int add_text(TextBuffer* buffer, const char* str, size_t length) {
+    if (buffer->size + length + 1 > buffer->capacity) {
+        buffer->capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+        while (buffer->size + length + 1 > buffer->capacity) {
+            buffer->capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+
+    int offset = (int)buffer->size;
+    memcpy(buffer->data + buffer->size, str, length);
+    buffer->data[buffer->size + length] = '\0';
+    buffer->size += length + 1;
+    return offset;
+}
+
+static void append(TextBuffer* buffer, const char* str) {
+    add_text(buffer, str, strlen(str));
+    buffer->size--; // Drop the terminator, the next append continues the string
+}
+
+static void append_json_string(TextBuffer* buffer, const char* str) {
+    append(buffer, "\"");
+    for (const char* c = str; *c != '\0'; c++) {
+        char escaped[8];
+        if (*c == '"' || *c == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = *c;
+            escaped[2] = '\0';
+        }
+        else if ((unsigned char)*c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+        }
+        else {
+            escaped[0] = *c;
+            escaped[1] = '\0';
+        }
+        append(buffer, escaped);
+    }
+    append(buffer, "\"");
+}
@@ -0,0 +1,56 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <stdbool.h>
+#include <stdarg.h>
+
+/*
+* Diagnostics are collected in memory and written in one go by flush_diagnostics,
+* either as text ("file:line:column: error: message [code]") or as a JSON array.
+* Once the error limit is reached further errors are only counted and callers are
+* expected to stop (see error_limit_reached).
+*/
+
+typedef enum {
+    SEVERITY_ERROR,
+    SEVERITY_WARNING,
+    SEVERITY_NOTE,
+} Severity;
+
+// Stable identifiers for tooling
+typedef enum {
+    DIAGNOSTIC_SYNTAX,              // malformed statement or operand
+    DIAGNOSTIC_UNKNOWN_INSTRUCTION,
+    DIAGNOSTIC_INVALID_REGISTER,
+    DIAGNOSTIC_UNDEFINED_SYMBOL,
+    DIAGNOSTIC_DUPLICATE_SYMBOL,
+    DIAGNOSTIC_OUT_OF_RANGE,        // value does not fit its field or the address space
+    DIAGNOSTIC_TARGET,              // instruction not available on the selected target
+    DIAGNOSTIC_LAYOUT,              // REPT, ORG and SECTION structure and placement
+    DIAGNOSTIC_NOT_RELOCATABLE,
+    DIAGNOSTIC_LINK,
+    DIAGNOSTIC_IO,
+    DIAGNOSTIC_ERROR_LIMIT,
+    DIAGNOSTIC_OPTIMIZATION,        // --dedup or --superopt moved code the program reaches by address
+} DiagnosticCode;
+
+typedef enum {
+    DIAGNOSTICS_TEXT,
+    DIAGNOSTICS_JSON,
+} DiagnosticsFormat;
+
+// max_errors 0 means no limit
+void configure_diagnostics(DiagnosticsFormat format, int max_errors);
+
+// file may be NULL and line 0 for diagnostics without a source location
+void report(Severity severity, DiagnosticCode code, const char* file, int line, int column, const char* fmt, ...);
+void report_va(Severity severity, DiagnosticCode code, const char* file, int line, int column, const char* fmt, va_list args);
+
+int error_count(void);
+int warning_count(void);
+bool error_limit_reached(void);
+
+// Writes the collected diagnostics (text to stdout, JSON to stderr) and starts over
+void flush_diagnostics(void);
+
+#endif // !DIAGNOSTICS_H
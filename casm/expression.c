@@ -0,0 +1,326 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expression.h"
+
+typedef struct {
+    const char* source;
+    int position;
+    long current_address;
+    ResolveSymbol resolve;
+    void* context;
+    Expression* result;
+} Evaluator;
+
+typedef struct {
+    long value;
+    int label_weight;
+    long base;          // address of the label term
+} Value;
+
+static Value parse_or(Evaluator* evaluator);
+
+static void fail(Evaluator* evaluator, const char* message) {
+    if (evaluator->result->error == NULL) {
+        evaluator->result->error = message;
+        evaluator->result->error_offset = evaluator->position;
+    }
+}
+
+static void fail_range(Evaluator* evaluator, const char* message) {
+    if (evaluator->result->error == NULL) {
+        evaluator->result->out_of_range = true;
+    }
+    fail(evaluator, message);
+}
+
+bool is_expression_end(char c) {
+    return c == '\0' || c == ',' || c == ';' || c == '\n' || c == '\r';
+}
+
+static void skip_spaces(Evaluator* evaluator) {
+    char c = evaluator->source[evaluator->position];
+    while (c == ' ' || c == '\t') {
+        c = evaluator->source[++evaluator->position];
+    }
+}
+
+static bool is_symbol_start(char c) {
+    return isalpha((unsigned char)c) || c == '_' || c == '.';
+}
+
+static bool is_symbol_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+// Any operation other than + and - on a label yields a value the linker can not relocate
+static Value absolute(Evaluator* evaluator, Value a, Value b, long value) {
+    if (a.label_weight != 0 || b.label_weight != 0) {
+        evaluator->result->nonlinear = true;
+    }
+    Value result = { value, 0, 0 };
+    return result;
+}
+
+static bool match(Evaluator* evaluator, const char* op) {
+    skip_spaces(evaluator);
+    size_t length = strlen(op);
+    if (strncmp(evaluator->source + evaluator->position, op, length) != 0) {
+        return false;
+    }
+    evaluator->position += (int)length;
+    return true;
+}
+
+static Value parse_number(Evaluator* evaluator) {
+    const char* start = evaluator->source + evaluator->position;
+    char* end;
+    long value;
+
+    errno = 0;
+    if (start[0] == '0' && (start[1] == 'b' || start[1] == 'B')) {
+        value = strtol(start + 2, &end, 2);
+        if (end == start + 2) {
+            fail(evaluator, "invalid binary number");
+        }
+    }
+    else if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) {
+        value = strtol(start + 2, &end, 16);
+        if (end == start + 2) {
+            fail(evaluator, "invalid hexadecimal number");
+        }
+    }
+    else {
+        value = strtol(start, &end, 10);
+    }
+    if (errno == ERANGE) {
+        fail_range(evaluator, "number out of range");
+    }
+
+    if (is_symbol_char(*end)) {
+        fail(evaluator, "invalid number");
+    }
+
+    evaluator->position += (int)(end - start);
+    Value result = { value, 0, 0 };
+    return result;
+}
+
+static Value parse_symbol(Evaluator* evaluator) {
+    Value result = { 0, 0, 0 };
+    int start = evaluator->position;
+    while (is_symbol_char(evaluator->source[evaluator->position])) {
+        evaluator->position++;
+    }
+
+    int length = evaluator->position - start;
+    char name[MAX_LABEL_LENGTH];
+    if (length >= MAX_LABEL_LENGTH) {
+        fail(evaluator, "symbol name too long");
+        return result;
+    }
+    memcpy(name, evaluator->source + start, length);
+    name[length] = '\0';
+
+    bool is_high = strcmp(name, "HIGH") == 0;
+    if (is_high || strcmp(name, "LOW") == 0) {
+        if (!match(evaluator, "(")) {
+            fail(evaluator, "expected '(' after HIGH/LOW");
+            return result;
+        }
+        Value operand = parse_or(evaluator);
+        if (!match(evaluator, ")")) {
+            fail(evaluator, "expected ')'");
+        }
+        long value = is_high ? (operand.value >> 8) & 0xFF : operand.value & 0xFF;
+        return absolute(evaluator, operand, result, value);
+    }
+
+    SymbolKind kind = evaluator->resolve(evaluator->context, name, &result.value, &result.label_weight, &result.base);
+    if (kind != SYMBOL_CONSTANT) {
+        evaluator->result->address_dependent = true;
+    }
+    if (kind == SYMBOL_UNDEFINED) {
+        if (evaluator->result->unresolved[0] == '\0') {
+            strcpy(evaluator->result->unresolved, name);
+        }
+        result.value = 0;
+        result.label_weight = 1;
+        result.base = 0;
+    }
+    return result;
+}
+
+static Value parse_primary(Evaluator* evaluator) {
+    skip_spaces(evaluator);
+    char c = evaluator->source[evaluator->position];
+
+    if (match(evaluator, "(")) {
+        Value value = parse_or(evaluator);
+        if (!match(evaluator, ")")) {
+            fail(evaluator, "expected ')'");
+        }
+        return value;
+    }
+    if (c == '$') {
+        evaluator->position++;
+        evaluator->result->address_dependent = true;
+        evaluator->result->uses_location = true;
+        Value value = { evaluator->current_address, 1, evaluator->current_address };
+        return value;
+    }
+    if (isdigit((unsigned char)c)) {
+        return parse_number(evaluator);
+    }
+    if (is_symbol_start(c)) {
+        return parse_symbol(evaluator);
+    }
+
+    fail(evaluator, is_expression_end(c) ? "expected an operand" : "unexpected character in expression");
+    Value value = { 0, 0, 0 };
+    return value;
+}
+
+static Value parse_unary(Evaluator* evaluator) {
+    if (match(evaluator, "-")) {
+        Value value = parse_unary(evaluator);
+        value.value = -value.value;
+        value.label_weight = -value.label_weight;
+        return value;
+    }
+    if (match(evaluator, "+")) {
+        return parse_unary(evaluator);
+    }
+    if (match(evaluator, "~")) {
+        Value value = parse_unary(evaluator);
+        Value none = { 0, 0, 0 };
+        return absolute(evaluator, value, none, ~value.value);
+    }
+    return parse_primary(evaluator);
+}
+
+static Value parse_multiplicative(Evaluator* evaluator) {
+    Value left = parse_unary(evaluator);
+    for (;;) {
+        if (match(evaluator, "*")) {
+            Value right = parse_unary(evaluator);
+            left = absolute(evaluator, left, right, left.value * right.value);
+        }
+        else if (match(evaluator, "/") || match(evaluator, "%")) {
+            bool is_division = evaluator->source[evaluator->position - 1] == '/';
+            Value right = parse_unary(evaluator);
+            if (right.value == 0) {
+                fail(evaluator, "division by zero");
+                right.value = 1;
+            }
+            left = absolute(evaluator, left, right, is_division ? left.value / right.value : left.value % right.value);
+        }
+        else {
+            return left;
+        }
+    }
+}
+
+static Value parse_additive(Evaluator* evaluator) {
+    Value left = parse_multiplicative(evaluator);
+    for (;;) {
+        if (match(evaluator, "+")) {
+            Value right = parse_multiplicative(evaluator);
+            left.base = left.label_weight != 0 ? left.base : right.base;
+            left.value += right.value;
+            left.label_weight += right.label_weight;
+        }
+        else if (match(evaluator, "-")) {
+            Value right = parse_multiplicative(evaluator);
+            left.base = left.label_weight != 0 ? left.base : right.base;
+            left.value -= right.value;
+            left.label_weight -= right.label_weight;
+        }
+        else {
+            return left;
+        }
+    }
+}
+
+static Value parse_shift_count(Evaluator* evaluator) {
+    Value count = parse_additive(evaluator);
+    if (count.value < 0 || count.value > 31) {
+        fail_range(evaluator, "shift count out of range (0-31)");
+        count.value = 0;
+    }
+    return count;
+}
+
+static Value parse_shift(Evaluator* evaluator) {
+    Value left = parse_additive(evaluator);
+    for (;;) {
+        if (match(evaluator, "<<")) {
+            Value right = parse_shift_count(evaluator);
+            left = absolute(evaluator, left, right, left.value << right.value);
+        }
+        else if (match(evaluator, ">>")) {
+            Value right = parse_shift_count(evaluator);
+            left = absolute(evaluator, left, right, left.value >> right.value);
+        }
+        else {
+            return left;
+        }
+    }
+}
+
+static Value parse_and(Evaluator* evaluator) {
+    Value left = parse_shift(evaluator);
+    while (match(evaluator, "&")) {
+        Value right = parse_shift(evaluator);
+        left = absolute(evaluator, left, right, left.value & right.value);
+    }
+    return left;
+}
+
+static Value parse_xor(Evaluator* evaluator) {
+    Value left = parse_and(evaluator);
+    while (match(evaluator, "^")) {
+        Value right = parse_and(evaluator);
+        left = absolute(evaluator, left, right, left.value ^ right.value);
+    }
+    return left;
+}
+
+static Value parse_or(Evaluator* evaluator) {
+    Value left = parse_xor(evaluator);
+    while (match(evaluator, "|")) {
+        Value right = parse_xor(evaluator);
+        left = absolute(evaluator, left, right, left.value | right.value);
+    }
+    return left;
+}
+
+bool evaluate_expression(const char* source, int offset, long current_address, ResolveSymbol resolve, void* context, Expression* result) {
+    memset(result, 0, sizeof(Expression));
+
+    Evaluator evaluator;
+    evaluator.source = source;
+    evaluator.position = offset;
+    evaluator.current_address = current_address;
+    evaluator.resolve = resolve;
+    evaluator.context = context;
+    evaluator.result = result;
+
+    Value value = parse_or(&evaluator);
+    skip_spaces(&evaluator);
+    if (!is_expression_end(source[evaluator.position])) {
+        fail(&evaluator, "unexpected character in expression");
+        // Skip the rest of the operand so parsing can continue after it
+        while (!is_expression_end(source[evaluator.position])) {
+            evaluator.position++;
+        }
+    }
+
+    result->value = value.value;
+    result->label_weight = value.label_weight;
+    result->label_base = value.base;
+    result->end = evaluator.position;
+    return result->error == NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include <stdbool.h>
+
+#include "parser.h"
+
+/*
+* Operand expressions, evaluated at assembly time:
+*
+*   primary:  number (123, 0x7B, 0b1111011), symbol, $ (current address), ( expr )
+*   unary:    - ~ + HIGH( expr ) LOW( expr )
+*   binary:   * / %   + -   << >>   &   ^   |   (C precedence)
+*
+* Labels are tracked through the expression so relocatable objects can tell whether
+* the result is "label + constant" (relocatable) or a plain number.
+*/
+
+typedef enum {
+    SYMBOL_UNDEFINED,
+    SYMBOL_CONSTANT,
+    SYMBOL_ADDRESS_CONSTANT,    // constant whose value was derived from an address
+    SYMBOL_LABEL,
+} SymbolKind;
+
+// Resolves a symbol. label_weight is 1 for labels (or constants derived from one label),
+// label_base is then the address of that label.
+typedef SymbolKind (*ResolveSymbol)(void* context, const char* name, long* value, int* label_weight, long* label_base);
+
+typedef struct {
+    long value;
+    int label_weight;               // net number of label terms, 1 for "label + constant"
+    long label_base;                // address of the label (or $) in "label + constant"
+    bool nonlinear;                 // a label was used in something else than + or -
+    bool address_dependent;         // uses a label, $ or a constant derived from them
+    bool uses_location;             // uses $
+    char unresolved[MAX_LABEL_LENGTH]; // first undefined symbol, treated as a label with value 0
+    const char* error;              // NULL on success
+    bool out_of_range;              // the error is an overflow, not malformed input
+    int error_offset;
+    int end;                        // source offset right after the expression
+} Expression;
+
+bool evaluate_expression(const char* source, int offset, long current_address, ResolveSymbol resolve, void* context, Expression* result);
+bool is_expression_end(char c);
+
+#endif // !EXPRESSION_H
@@ -12,7 +12,7 @@
 #include "util.h"
 #include "lexer.h"
 
-void add_token(TokenArray* token_array, const char* start, int length, int line) {
+void add_token(TokenArray* token_array, const char* start, int length, int offset) {
     if (token_array->count >= token_array->capacity) {
         token_array->capacity *= 2;
         token_array->tokens = realloc(token_array->tokens, token_array->capacity * sizeof(Token));
@@ -21,11 +21,11 @@ void add_token(TokenArray* token_array, const char* start, int length, int line)
     token.value = malloc((length + 1) * sizeof(char));
     strncpy(token.value, start, length);
     token.value[length] = '\0';
-    token.line = line;
+    token.offset = offset;
     token_array->tokens[token_array->count++] = token;
 }
 
-void add_eof_token(TokenArray* token_array, int line) {
+void add_eof_token(TokenArray* token_array, int offset) {
     if (token_array->count >= token_array->capacity) {
         token_array->capacity *= 2;
         token_array->tokens = realloc(token_array->tokens, token_array->capacity * sizeof(Token));
@@ -36,7 +36,7 @@ void add_eof_token(TokenArray* token_array, int line) {
 
     strncpy(token.value, "EOF", 4);
     token.value[3] = '\0';
-    token.line = line;
+    token.offset = offset;
     token_array->tokens[token_array->count++] = token;
 }
 
@@ -44,47 +44,96 @@ bool is_token_separator(char c) {
     return isspace(c) || c == '\0';
 }
 
-TokenArray tokenize(const char* code) {
+TokenArray tokenize(const char* code, const char* filename) {
     TokenArray token_array;
     token_array.count = 0;
     token_array.capacity = 16;
     token_array.tokens = malloc(token_array.capacity * sizeof(Token));
+    token_array.source = code;
+    token_array.filename = filename;
+    token_array.line_index.offsets = NULL;
+    token_array.line_index.count = 0;
 
     const char* start = code;
     const char* end = code;
-    int line = 1;
 
     while (*end != '\0') {
         if (is_token_separator(*end)) {
             if (end > start) {
-                add_token(&token_array, start, end - start, line);
-            }
-            if (*end == '\n') {
-                line++;
+                add_token(&token_array, start, end - start, start - code);
             }
             start = end + 1;
         }
         else if (*end == ',' || *end == ';') {
             if (end > start) {
-                add_token(&token_array, start, end - start, line);
+                add_token(&token_array, start, end - start, start - code);
             }
-            add_token(&token_array, end, 1, line);
+            add_token(&token_array, end, 1, end - code);
             start = end + 1;
         }
         end++;
     }
     if (end > start) {
-        add_token(&token_array, start, end - start, line);
+        add_token(&token_array, start, end - start, start - code);
     }
 
-    add_eof_token(&token_array, line+1);
+    add_eof_token(&token_array, end - code);
 
     return token_array;
 }
 
+// Lines are only needed for diagnostics, so the index is built the first time a
+// location is resolved. memchr skips over whole lines at a time (vectorized in
+// every common C library) instead of testing each character.
+static void build_line_index(TokenArray* token_array) {
+    const char* code = token_array->source;
+    size_t length = strlen(code);
+    int capacity = 64;
+
+    LineIndex* index = &token_array->line_index;
+    index->offsets = malloc(capacity * sizeof(int));
+    index->offsets[0] = 0;
+    index->count = 1;
+
+    const char* cursor = code;
+    const char* end = code + length;
+    while ((cursor = memchr(cursor, '\n', end - cursor)) != NULL) {
+        cursor++;
+        if (index->count >= capacity) {
+            capacity *= 2;
+            index->offsets = realloc(index->offsets, capacity * sizeof(int));
+        }
+        index->offsets[index->count++] = (int)(cursor - code);
+    }
+}
+
+void resolve_location(TokenArray* token_array, int offset, int* line, int* column) {
+    if (token_array->line_index.offsets == NULL) {
+        build_line_index(token_array);
+    }
+
+    // Find the last line starting at or before offset
+    const int* offsets = token_array->line_index.offsets;
+    int low = 0;
+    int high = token_array->line_index.count - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (offsets[mid] <= offset) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+
+    *line = low + 1;
+    *column = offset - offsets[low] + 1;
+}
+
 void free_token_array(TokenArray* token_array) {
     for (int i = 0; i < token_array->count; i++) {
         free(token_array->tokens[i].value);
     }
     free(token_array->tokens);
+    free(token_array->line_index.offsets);
 }
\ No newline at end of file
@@ -5,18 +5,28 @@
 
 typedef struct {
     char* value;
-    int line;
+    int offset; // Byte offset into the source, see resolve_location()
 } Token;
 
+// Byte offsets of the first character of every line, built on demand
+typedef struct {
+    int* offsets;
+    int count;
+} LineIndex;
+
 typedef struct {
     Token* tokens;
     int count;
     int capacity;
+    const char* source;
+    const char* filename;
+    LineIndex line_index;
 } TokenArray;
 
-void add_token(TokenArray* token_array, const char* start, int length, int line);
+void add_token(TokenArray* token_array, const char* start, int length, int offset);
 bool is_token_separator(char c);
-TokenArray tokenize(const char* code);
+TokenArray tokenize(const char* code, const char* filename);
+void resolve_location(TokenArray* token_array, int offset, int* line, int* column);
 void free_token_array(TokenArray* token_array);
 
 #endif // !LEXER_H
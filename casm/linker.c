@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "object.h"
+#include "linker.h"
+#include "diagnostics.h"
+
+#define PROGRAM_START 0x200
+
+typedef struct {
+    const ObjectSymbol* symbol;
+    int address;
+} SymbolSlot;
+
+typedef struct {
+    SymbolSlot* slots;
+    uint32_t mask;
+} SymbolTable;
+
+static void init_symbol_table(SymbolTable* table, int symbol_count);
+static bool insert_symbol(SymbolTable* table, const ObjectSymbol* symbol, int address);
+static int find_symbol(SymbolTable* table, const ObjectSymbol* symbol);
+
+int place_objects(const ObjectFile* objects, int object_count, int* bases) {
+    // Lay the objects out sequentially
+    int address = PROGRAM_START;
+    for (int i = 0; i < object_count; i++) {
+        bases[i] = address;
+        address += objects[i].code_size;
+    }
+    return address;
+}
+
+bool link_objects(ObjectFile* objects, int object_count, uint8_t** image, int* image_size) {
+    bool success = true;
+
+    int* bases = malloc((object_count > 0 ? object_count : 1) * sizeof(int));
+    int address = place_objects(objects, object_count, bases);
+    int export_count = 0;
+    int max_address = target_max_address(TARGET_CHIP8);
+    for (int i = 0; i < object_count; i++) {
+        export_count += objects[i].export_count;
+        if (target_max_address(objects[i].target) > max_address) {
+            max_address = target_max_address(objects[i].target);
+        }
+    }
+
+    *image_size = address - PROGRAM_START;
+    *image = calloc(*image_size > 0 ? *image_size : 1, 1);
+
+    if (address > max_address + 1) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_OUT_OF_RANGE, NULL, 0, 0, "linked program (0x%X bytes) exceeds the address space (0x%X)", *image_size, max_address + 1);
+        free(bases);
+        return false;
+    }
+
+    SymbolTable table;
+    init_symbol_table(&table, export_count);
+
+    for (int i = 0; i < object_count; i++) {
+        ObjectFile* object = &objects[i];
+        int delta = bases[i] - object->origin;
+
+        memcpy(*image + (bases[i] - PROGRAM_START), object->code, object->code_size);
+
+        for (int j = 0; j < object->export_count; j++) {
+            if (!insert_symbol(&table, &object->exports[j], object->exports[j].address + delta)) {
+                report(SEVERITY_ERROR, DIAGNOSTIC_DUPLICATE_SYMBOL, NULL, 0, 0, "symbol '%s' defined in multiple objects", object->exports[j].name);
+                success = false;
+            }
+        }
+    }
+
+    for (int i = 0; i < object_count && success; i++) {
+        ObjectFile* object = &objects[i];
+        int delta = bases[i] - object->origin;
+
+        for (int j = 0; j < object->relocation_count; j++) {
+            ObjectRelocation* relocation = &object->relocations[j];
+            if (relocation->offset + 1 >= object->code_size) {
+                report(SEVERITY_ERROR, DIAGNOSTIC_LINK, NULL, 0, 0, "relocation at offset 0x%X is outside of the object code", relocation->offset);
+                success = false;
+                continue;
+            }
+
+            uint8_t* field = *image + (bases[i] - PROGRAM_START) + relocation->offset;
+            uint16_t opcode = (field[0] << 8) | field[1];
+            uint16_t mask = relocation->kind == RELOCATION_ADDRESS16 ? 0xFFFF : 0x0FFF;
+            int target = opcode & mask;
+
+            if (relocation->symbol == OBJECT_LOCAL_SYMBOL) {
+                target += delta;
+            }
+            else if (relocation->symbol < object->import_count) {
+                int symbol_address = find_symbol(&table, &object->imports[relocation->symbol]);
+                if (symbol_address == -1) {
+                    report(SEVERITY_ERROR, DIAGNOSTIC_UNDEFINED_SYMBOL, NULL, 0, 0, "undefined symbol '%s'", object->imports[relocation->symbol].name);
+                    success = false;
+                    continue;
+                }
+                target += symbol_address;
+            }
+            else {
+                report(SEVERITY_ERROR, DIAGNOSTIC_LINK, NULL, 0, 0, "relocation refers to invalid import %d", relocation->symbol);
+                success = false;
+                continue;
+            }
+
+            if (target > mask) {
+                report(SEVERITY_ERROR, DIAGNOSTIC_OUT_OF_RANGE, NULL, 0, 0, "relocated address (0x%X) does not fit into its %d-bit field", target, mask == 0xFFFF ? 16 : 12);
+                success = false;
+                continue;
+            }
+
+            opcode = (opcode & ~mask) | target;
+            field[0] = opcode >> 8;
+            field[1] = opcode & 0xFF;
+        }
+    }
+
+    free(table.slots);
+    free(bases);
+    return success;
+}
+
+/*********************************************************************************
+* Symbol hash table (open addressing, linear probing)
+*********************************************************************************/
+
+static void init_symbol_table(SymbolTable* table, int symbol_count) {
+    uint32_t capacity = 16;
+    while (capacity < (uint32_t)symbol_count * 2) {
+        capacity *= 2;
+    }
+    table->slots = calloc(capacity, sizeof(SymbolSlot));
+    table->mask = capacity - 1;
+}
+
+static bool insert_symbol(SymbolTable* table, const ObjectSymbol* symbol, int address) {
+    uint32_t index = symbol->hash & table->mask;
+    while (table->slots[index].symbol != NULL) {
+        const ObjectSymbol* existing = table->slots[index].symbol;
+        if (existing->hash == symbol->hash && strcmp(existing->name, symbol->name) == 0) {
+            return false;
+        }
+        index = (index + 1) & table->mask;
+    }
+    table->slots[index].symbol = symbol;
+    table->slots[index].address = address;
+    return true;
+}
+
+static int find_symbol(SymbolTable* table, const ObjectSymbol* symbol) {
+    uint32_t index = symbol->hash & table->mask;
+    while (table->slots[index].symbol != NULL) {
+        const ObjectSymbol* existing = table->slots[index].symbol;
+        if (existing->hash == symbol->hash && strcmp(existing->name, symbol->name) == 0) {
+            return table->slots[index].address;
+        }
+        index = (index + 1) & table->mask;
+    }
+    return -1;
+}
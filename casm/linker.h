@@ -0,0 +1,18 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "object.h"
+
+// Computes the load address of each object as link_objects() lays them out and returns
+// the address just past the last one.
+int place_objects(const ObjectFile* objects, int object_count, int* bases);
+
+// Places the objects one after another starting at 0x200, resolves imports against
+// the exports of all objects and applies the relocations. The resulting image starts
+// at 0x200 and can be written to disk as ROM.
+bool link_objects(ObjectFile* objects, int object_count, uint8_t** image, int* image_size);
+
+#endif // !LINKER_H
@@ -0,0 +1,437 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "machine.h"
+
+#define LANES MACHINE_BLOCK_LANES
+#define MEMORY_SIZE 0x1000
+#define PROGRAM_START 0x200
+#define STACK_SIZE 16
+#define SCREEN_HEIGHT 32
+
+typedef struct {
+    const LaneConfig* configs;          // config of the first lane of the block
+    int lane_count;                     // lanes in use, the rest are padding
+    uint8_t v[16][LANES];
+    uint16_t i[LANES];
+    uint16_t pc[LANES];
+    uint8_t dt[LANES];
+    uint8_t st[LANES];
+    uint8_t sp[LANES];
+    uint16_t stack[STACK_SIZE][LANES];
+    uint32_t rng[LANES];
+    uint16_t keys[LANES];
+    int next_event[LANES];
+    bool stopped[LANES];
+    LaneResult results[LANES];
+    bool memory_diverged;               // a lane wrote memory, opcodes may differ per lane
+    uint64_t framebuffer[LANES][SCREEN_HEIGHT]; // bit 63 is the leftmost pixel
+    uint8_t memory[LANES][MEMORY_SIZE];
+} LaneBlock;
+
+static const uint8_t font[80] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0, 0x20, 0x60, 0x20, 0x20, 0x70,
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, 0xF0, 0x10, 0xF0, 0x10, 0xF0,
+    0x90, 0x90, 0xF0, 0x10, 0x10, 0xF0, 0x80, 0xF0, 0x10, 0xF0,
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, 0xF0, 0x10, 0x20, 0x40, 0x40,
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, 0xF0, 0x90, 0xF0, 0x10, 0xF0,
+    0xF0, 0x90, 0xF0, 0x90, 0x90, 0xE0, 0x90, 0xE0, 0x90, 0xE0,
+    0xF0, 0x80, 0x80, 0x80, 0xF0, 0xE0, 0x90, 0x90, 0x90, 0xE0,
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, 0xF0, 0x80, 0xF0, 0x80, 0x80,
+};
+
+static void init_block(LaneBlock* block, const uint8_t* image, int image_size, const LaneConfig* configs, int lane_count);
+static void run_block(LaneBlock* block, int frames, int cycles_per_frame);
+static void step_block(LaneBlock* block);
+static bool step_vector(LaneBlock* block, uint16_t opcode);
+static void step_lane(LaneBlock* block, int lane);
+static void fault_lane(LaneBlock* block, int lane, uint16_t opcode);
+
+void run_lockstep(const uint8_t* image, int image_size, const LaneConfig* lanes, int lane_count, int frames, int cycles_per_frame, LaneResult* results) {
+    int block_count = (lane_count + LANES - 1) / LANES;
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for (int b = 0; b < block_count; b++) {
+        int first_lane = b * LANES;
+        int count = lane_count - first_lane < LANES ? lane_count - first_lane : LANES;
+
+        LaneBlock* block = malloc(sizeof(LaneBlock));
+        init_block(block, image, image_size, lanes + first_lane, count);
+        run_block(block, frames, cycles_per_frame);
+
+        for (int l = 0; l < count; l++) {
+            results[first_lane + l] = block->results[l];
+            results[first_lane + l].framebuffer_hash = hash_bytes(block->framebuffer[l], sizeof(block->framebuffer[l]));
+            if (!block->stopped[l]) {
+                results[first_lane + l].pc = block->pc[l];
+            }
+        }
+        free(block);
+    }
+}
+
+static void init_block(LaneBlock* block, const uint8_t* image, int image_size, const LaneConfig* configs, int lane_count) {
+    memset(block, 0, sizeof(LaneBlock));
+    block->configs = configs;
+    block->lane_count = lane_count;
+
+    for (int l = 0; l < LANES; l++) {
+        memcpy(block->memory[l], font, sizeof(font));
+        memcpy(block->memory[l] + PROGRAM_START, image, image_size);
+        block->pc[l] = PROGRAM_START;
+        block->rng[l] = l < lane_count && configs[l].seed != 0 ? configs[l].seed : 0x9E3779B9u;
+        // Padding lanes never run
+        block->stopped[l] = l >= lane_count;
+    }
+}
+
+static void run_block(LaneBlock* block, int frames, int cycles_per_frame) {
+    for (int frame = 0; frame < frames; frame++) {
+        for (int l = 0; l < block->lane_count; l++) {
+            const LaneConfig* config = &block->configs[l];
+            while (block->next_event[l] < config->event_count && config->events[block->next_event[l]].frame <= frame) {
+                block->keys[l] = config->events[block->next_event[l]].keys;
+                block->next_event[l]++;
+            }
+        }
+
+        for (int cycle = 0; cycle < cycles_per_frame; cycle++) {
+            step_block(block);
+        }
+
+        for (int l = 0; l < LANES; l++) {
+            block->dt[l] -= block->dt[l] > 0;
+            block->st[l] -= block->st[l] > 0;
+        }
+    }
+}
+
+static void step_block(LaneBlock* block) {
+    int reference = -1;
+    bool uniform = true;
+
+    for (int l = 0; l < LANES; l++) {
+        if (block->stopped[l]) {
+            continue; // Stopped lanes keep their results, the vector path may clobber their registers
+        }
+        if (reference == -1) {
+            reference = l;
+        }
+        else if (block->pc[l] != block->pc[reference]) {
+            uniform = false;
+        }
+    }
+
+    if (reference == -1) {
+        return; // Every lane stopped
+    }
+
+    uint16_t pc = block->pc[reference];
+    uint16_t opcode = (block->memory[reference][pc & 0xFFF] << 8) | block->memory[reference][(pc + 1) & 0xFFF];
+
+    if (uniform && block->memory_diverged) {
+        for (int l = 0; l < LANES && uniform; l++) {
+            uniform = block->memory[l][pc & 0xFFF] == (opcode >> 8) && block->memory[l][(pc + 1) & 0xFFF] == (opcode & 0xFF);
+        }
+    }
+
+    if (uniform && step_vector(block, opcode)) {
+        return;
+    }
+
+    for (int l = 0; l < LANES; l++) {
+        if (!block->stopped[l]) {
+            step_lane(block, l);
+        }
+    }
+}
+
+// Executes an opcode for all lanes at once. Returns false for opcodes that need the
+// scalar interpreter.
+static bool step_vector(LaneBlock* block, uint16_t opcode) {
+    uint8_t x = (opcode >> 8) & 0xF;
+    uint8_t y = (opcode >> 4) & 0xF;
+    uint8_t kk = opcode & 0xFF;
+    uint16_t nnn = opcode & 0xFFF;
+    uint8_t* vx = block->v[x];
+    uint8_t* vy = block->v[y];
+    uint8_t* vf = block->v[0xF];
+
+    switch (opcode >> 12) {
+    case 0x1:
+        for (int l = 0; l < LANES; l++) {
+            block->pc[l] = nnn;
+        }
+        return true;
+    case 0x6:
+        for (int l = 0; l < LANES; l++) {
+            vx[l] = kk;
+        }
+        break;
+    case 0x7:
+        for (int l = 0; l < LANES; l++) {
+            vx[l] += kk;
+        }
+        break;
+    case 0x8:
+        switch (opcode & 0xF) {
+        case 0x0:
+            for (int l = 0; l < LANES; l++) {
+                vx[l] = vy[l];
+            }
+            break;
+        case 0x1:
+            for (int l = 0; l < LANES; l++) {
+                vx[l] |= vy[l];
+            }
+            break;
+        case 0x2:
+            for (int l = 0; l < LANES; l++) {
+                vx[l] &= vy[l];
+            }
+            break;
+        case 0x3:
+            for (int l = 0; l < LANES; l++) {
+                vx[l] ^= vy[l];
+            }
+            break;
+        case 0x4:
+            for (int l = 0; l < LANES; l++) {
+                unsigned sum = vx[l] + vy[l];
+                vx[l] = (uint8_t)sum;
+                vf[l] = (uint8_t)(sum >> 8);
+            }
+            break;
+        case 0x5:
+            for (int l = 0; l < LANES; l++) {
+                uint8_t a = vx[l];
+                uint8_t b = vy[l];
+                vx[l] = a - b;
+                vf[l] = a >= b;
+            }
+            break;
+        case 0x6:
+            for (int l = 0; l < LANES; l++) {
+                uint8_t a = vx[l];
+                vx[l] = a >> 1;
+                vf[l] = a & 1;
+            }
+            break;
+        case 0x7:
+            for (int l = 0; l < LANES; l++) {
+                uint8_t a = vx[l];
+                uint8_t b = vy[l];
+                vx[l] = b - a;
+                vf[l] = b >= a;
+            }
+            break;
+        case 0xE:
+            for (int l = 0; l < LANES; l++) {
+                uint8_t a = vx[l];
+                vx[l] = a << 1;
+                vf[l] = a >> 7;
+            }
+            break;
+        default:
+            return false;
+        }
+        break;
+    case 0xA:
+        for (int l = 0; l < LANES; l++) {
+            block->i[l] = nnn;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    for (int l = 0; l < LANES; l++) {
+        block->pc[l] += 2;
+    }
+    return true;
+}
+
+static uint32_t next_random(LaneBlock* block, int lane) {
+    // xorshift32
+    uint32_t state = block->rng[lane];
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    block->rng[lane] = state;
+    return state;
+}
+
+static void step_lane(LaneBlock* block, int lane) {
+    uint8_t* memory = block->memory[lane];
+    uint16_t pc = block->pc[lane];
+    uint16_t opcode = (memory[pc & 0xFFF] << 8) | memory[(pc + 1) & 0xFFF];
+    uint8_t x = (opcode >> 8) & 0xF;
+    uint8_t y = (opcode >> 4) & 0xF;
+    uint8_t n = opcode & 0xF;
+    uint8_t kk = opcode & 0xFF;
+    uint16_t nnn = opcode & 0xFFF;
+    uint8_t vx = block->v[x][lane];
+    uint8_t vy = block->v[y][lane];
+    uint16_t next_pc = pc + 2;
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00E0) {
+            memset(block->framebuffer[lane], 0, sizeof(block->framebuffer[lane]));
+        }
+        else if (opcode == 0x00EE) {
+            if (block->sp[lane] == 0) {
+                fault_lane(block, lane, opcode);
+                return;
+            }
+            next_pc = block->stack[--block->sp[lane]][lane];
+        }
+        else {
+            fault_lane(block, lane, opcode); // SYS and SUPER-CHIP opcodes
+            return;
+        }
+        break;
+    case 0x1:
+        next_pc = nnn;
+        break;
+    case 0x2:
+        if (block->sp[lane] >= STACK_SIZE) {
+            fault_lane(block, lane, opcode);
+            return;
+        }
+        block->stack[block->sp[lane]++][lane] = next_pc;
+        next_pc = nnn;
+        break;
+    case 0x3:
+        next_pc += vx == kk ? 2 : 0;
+        break;
+    case 0x4:
+        next_pc += vx != kk ? 2 : 0;
+        break;
+    case 0x5:
+        if (n != 0) {
+            fault_lane(block, lane, opcode);
+            return;
+        }
+        next_pc += vx == vy ? 2 : 0;
+        break;
+    case 0x6:
+    case 0x7:
+    case 0x8:
+        // Same semantics as the vector path, evaluated for this lane only
+        switch (opcode >> 12) {
+        case 0x6: block->v[x][lane] = kk; break;
+        case 0x7: block->v[x][lane] = vx + kk; break;
+        default:
+            switch (n) {
+            case 0x0: block->v[x][lane] = vy; break;
+            case 0x1: block->v[x][lane] = vx | vy; break;
+            case 0x2: block->v[x][lane] = vx & vy; break;
+            case 0x3: block->v[x][lane] = vx ^ vy; break;
+            case 0x4: block->v[x][lane] = vx + vy; block->v[0xF][lane] = (vx + vy) > 0xFF; break;
+            case 0x5: block->v[x][lane] = vx - vy; block->v[0xF][lane] = vx >= vy; break;
+            case 0x6: block->v[x][lane] = vx >> 1; block->v[0xF][lane] = vx & 1; break;
+            case 0x7: block->v[x][lane] = vy - vx; block->v[0xF][lane] = vy >= vx; break;
+            case 0xE: block->v[x][lane] = vx << 1; block->v[0xF][lane] = vx >> 7; break;
+            default:
+                fault_lane(block, lane, opcode);
+                return;
+            }
+        }
+        break;
+    case 0x9:
+        if (n != 0) {
+            fault_lane(block, lane, opcode);
+            return;
+        }
+        next_pc += vx != vy ? 2 : 0;
+        break;
+    case 0xA:
+        block->i[lane] = nnn;
+        break;
+    case 0xB:
+        next_pc = nnn + block->v[0][lane];
+        break;
+    case 0xC:
+        block->v[x][lane] = (uint8_t)next_random(block, lane) & kk;
+        break;
+    case 0xD: {
+        int column = vx % 64;
+        int row = vy % SCREEN_HEIGHT;
+        uint8_t collision = 0;
+        for (int r = 0; r < n && row + r < SCREEN_HEIGHT; r++) {
+            uint64_t bits = ((uint64_t)memory[(block->i[lane] + r) & 0xFFF] << 56) >> column;
+            collision |= (block->framebuffer[lane][row + r] & bits) != 0;
+            block->framebuffer[lane][row + r] ^= bits;
+        }
+        block->v[0xF][lane] = collision;
+        break;
+    }
+    case 0xE:
+        if (kk == 0x9E) {
+            next_pc += (block->keys[lane] >> (vx & 0xF)) & 1 ? 2 : 0;
+        }
+        else if (kk == 0xA1) {
+            next_pc += (block->keys[lane] >> (vx & 0xF)) & 1 ? 0 : 2;
+        }
+        else {
+            fault_lane(block, lane, opcode);
+            return;
+        }
+        break;
+    case 0xF:
+        switch (kk) {
+        case 0x07: block->v[x][lane] = block->dt[lane]; break;
+        case 0x0A:
+            if (block->keys[lane] == 0) {
+                next_pc = pc; // Wait for a key
+            }
+            else {
+                for (int key = 0; key < 16; key++) {
+                    if ((block->keys[lane] >> key) & 1) {
+                        block->v[x][lane] = (uint8_t)key;
+                        break;
+                    }
+                }
+            }
+            break;
+        case 0x15: block->dt[lane] = vx; break;
+        case 0x18: block->st[lane] = vx; break;
+        case 0x1E: block->i[lane] += vx; break;
+        case 0x29: block->i[lane] = (vx & 0xF) * 5; break;
+        case 0x33:
+            memory[block->i[lane] & 0xFFF] = vx / 100;
+            memory[(block->i[lane] + 1) & 0xFFF] = (vx / 10) % 10;
+            memory[(block->i[lane] + 2) & 0xFFF] = vx % 10;
+            block->memory_diverged = true;
+            break;
+        case 0x55:
+            for (int r = 0; r <= x; r++) {
+                memory[(block->i[lane] + r) & 0xFFF] = block->v[r][lane];
+            }
+            block->memory_diverged = true;
+            break;
+        case 0x65:
+            for (int r = 0; r <= x; r++) {
+                block->v[r][lane] = memory[(block->i[lane] + r) & 0xFFF];
+            }
+            break;
+        default:
+            fault_lane(block, lane, opcode);
+            return;
+        }
+        break;
+    }
+
+    block->pc[lane] = next_pc;
+}
+
+static void fault_lane(LaneBlock* block, int lane, uint16_t opcode) {
+    block->stopped[lane] = true;
+    block->results[lane].faulted = true;
+    block->results[lane].pc = block->pc[lane];
+    block->results[lane].opcode = opcode;
+}
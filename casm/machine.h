@@ -0,0 +1,45 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+* Lockstep CHIP-8 execution of one image on many machine instances (lanes).
+*
+* Lanes are grouped into blocks of MACHINE_BLOCK_LANES with their state stored as
+* structure of arrays. While every lane of a block is at the same PC, ALU opcodes
+* (6xkk, 7xkk, 8xy0 - 8xyE) and a few others run as loops over the lanes, which the
+* compiler vectorizes. Diverged lanes fall back to a scalar interpreter. Blocks are
+* independent and run in parallel when built with OpenMP.
+*
+* Semantics: SHR/SHL shift Vx in place, VF is written after the result, logic opcodes
+* leave VF alone, Fx55/Fx65 leave I unchanged, DRW clips at the screen edges.
+* Memory is 4 KB, larger images (XO-CHIP) can not be run.
+*/
+
+#define MACHINE_BLOCK_LANES 32
+#define MACHINE_MAX_IMAGE_SIZE (0x1000 - 0x200)
+
+typedef struct {
+    int frame;
+    uint16_t keys;      // bit n set: key n is held down from this frame on
+} KeyEvent;
+
+typedef struct {
+    uint32_t seed;
+    const KeyEvent* events; // sorted by frame
+    int event_count;
+} LaneConfig;
+
+typedef struct {
+    uint32_t framebuffer_hash;
+    bool faulted;       // invalid opcode, stack fault or unsupported instruction
+    uint16_t pc;
+    uint16_t opcode;    // opcode at pc when the lane faulted
+} LaneResult;
+
+// image_size must not exceed MACHINE_MAX_IMAGE_SIZE
+void run_lockstep(const uint8_t* image, int image_size, const LaneConfig* lanes, int lane_count, int frames, int cycles_per_frame, LaneResult* results);
+
+#endif // !MACHINE_H
@@ -1,61 +1,592 @@
+#if defined(_MSC_VER) || defined(__STDC_LIB_EXT1__)
+#define _CRT_SECURE_NO_WARNINGS
+#pragma warning(disable: 4996)
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
 #include "lexer.h"
 #include "parser.h"
+#include "object.h"
+#include "linker.h"
+#include "cache.h"
+#include "watch.h"
+#include "debuginfo.h"
+#include "diagnostics.h"
+#include "machine.h"
+
+typedef struct {
+    int lanes;
+    int frames;
+    int cycles_per_frame;
+    const char* script_path;
+} RunOptions;
+
+static void print_usage(void) {
+    printf("Usage: casm [options] <input>...\n");
+    printf("\n");
+    printf("Inputs are assembly sources or object files produced with -c.\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("  -c                 assemble each source into a relocatable object file (.o)\n");
+    printf("  -o <file>          output file (default: first input with .ch8 or .o extension)\n");
+    printf("  --target <t>       instruction set and address space: chip8 (default), schip, xochip\n");
+    printf("  --max-errors <n>   stop after n errors (default 100, 0 = no limit)\n");
+    printf("  --diagnostics <f>  diagnostics format: text (default) or json (written to stderr)\n");
+    printf("  --watch            rebuild the ROM whenever an input changes\n");
+    printf("  --cache <d>        reuse objects of unchanged sources from (and store new ones in) directory d\n");
+    printf("  --dedup            merge identical data blocks (and blocks that are suffixes of others)\n");
+    printf("  --superopt <f>     replace register arithmetic by shorter equivalent sequences, caching results in rewrite table f\n");
+    printf("  --map              print the memory layout (ORG blocks, sections, free space)\n");
+    printf("  -g                 write source lines and labels of the ROM to a debug info file (.dbg)\n");
+    printf("  --run <n>          run the ROM on n machine instances in lockstep and report framebuffer hashes\n");
+    printf("  --frames <n>       frames to run (default 600)\n");
+    printf("  --cycles <n>       instructions per frame (default 10)\n");
+    printf("  --script <f>       input scripts, one lane per line: seed frame:keys frame:keys ...\n");
+}
+
+// Returns a newly allocated copy of path with its extension replaced
+static char* replace_extension(const char* path, const char* extension) {
+    const char* dot = strrchr(path, '.');
+    const char* separator = strrchr(path, '/');
+    const char* backslash = strrchr(path, '\\');
+    if (backslash > separator) {
+        separator = backslash;
+    }
+    size_t length = (dot != NULL && dot > separator) ? (size_t)(dot - path) : strlen(path);
+
+    char* result = malloc(length + strlen(extension) + 1);
+    memcpy(result, path, length);
+    strcpy(result + length, extension);
+    return result;
+}
+
+// Assembles a source into an object file unless the existing object was built
+// from the same source content with the same options.
+static bool compile_source(const char* input_path, const char* output_path, const ParseOptions* options, const char* cache_directory) {
+    size_t size;
+    char* source = read_file(input_path, &size);
+    if (source == NULL) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "could not read '%s'", input_path);
+        return false;
+    }
+
+    ObjectFile header;
+    if (read_object_header(output_path, &header) && object_matches(&header, source, options)) {
+        printf("%s is up to date\n", output_path);
+        free(source);
+        return true;
+    }
+
+    ObjectFile object;
+    bool success = assemble_cached(cache_directory, source, size, input_path, true, options, &object);
+    free(source);
+
+    if (success) {
+        success = write_object(output_path, &object);
+        if (!success) {
+            report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "could not write '%s'", output_path);
+        }
+    }
 
-int main() {
-    //const char* code =
-    //    "CLS\n"             // Clear the screen
-    //    "SNE V0"     // SNE V0, byte: Skip next instruction if V0 != 0x42
-    //    "SNE V0, V1\n"       // SNE V0, V1: Skip next instruction if V0 != V1
-    //    "OR V0, V1\n"        // OR V0, V1: V0 = V0 | V1
-    //    "AND V0, V1\n"       // AND V0, V1: V0 = V0 & V1
-    //    "XOR V0, V1\n"       // XOR V0, V1: V0 = V0 ^ V1
-    //    "SUB V0, V1\n"       // SUB V0, V1: V0 = V0 - V1
-    //    "SHR V0\n"           // SHR V0: V0 = V0 >> 1
-    //    "SUBN V0, V1\n"      // SUBN V0, V1: V0 = V1 - V0
-    //    "SHL V0\n"           // SHL V0: V0 = V0 << 1
-    //    "RND V0, 0x42\n"     // RND V0, byte: V0 = random byte & 0x42
-    //    "SKP V0\n"           // SKP V0: Skip next instruction if key with the value of V0 is pressed
-    //    "SKNP V0\n"          // SKNP V0: Skip next instruction if key with the value of V0 is not pressed
-    //    "DRW V0, V1, 0x5\n"  // DRW V0, V1, nibble: Draw 5-byte sprite at (V0, V1)
-    //    ;
-
-    const char* code =
-        "CLS\n"             // Clear the screen
-        "SYS 0x200\n"       // SYS with immediate address: SYS 0x200
-        "CALL label1\n"     // CALL with label: CALL label1
-        "RET\n"             // Return from subroutine
-        "label1:\n"         // Label definition
-        "CLS\n"             // Clear the screen (inside label1)
-        "SYS label2\n"      // SYS with label: SYS label2
-        "CALL 0x20A\n"      // CALL with immediate address: CALL 0x20A
-        "RET\n"             // Return from subroutine
-        "label2:\n"         // Label definition
-        "CLS\n"             // Clear the screen (inside label2)
-        ;
-
-    // Lexer
-    TokenArray token_array = tokenize(code);
-    printf("Tokens:\n");
-    for (int i = 0; i < token_array.count; i++) {
-        printf("Token %d (line %d): %s\n", i, token_array.tokens[i].line, token_array.tokens[i].value);
-    }
-
-    // Parser
-    OpcodeArray opcode_array;
-    bool success = parse(&token_array, &opcode_array);
+    free_object(&object);
+    return success;
+}
+
+// Loads an object file or assembles a source
+static bool load_input(const char* path, bool relocatable, const ParseOptions* options, const char* cache_directory, ObjectFile* object) {
+    size_t size;
+    char* data = read_file(path, &size);
+    if (data == NULL) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "could not read '%s'", path);
+        memset(object, 0, sizeof(ObjectFile));
+        return false;
+    }
+
+    bool success;
+    if (is_object_file(data, size)) {
+        success = deserialize_object((const uint8_t*)data, size, path, object);
+    }
+    else {
+        success = assemble_cached(cache_directory, data, size, path, relocatable, options, object);
+    }
+    free(data);
+    return success;
+}
+
+// Links the objects and replaces the ROM at output_path, and the debug info at
+// debug_path unless it is NULL. If image is not NULL the caller takes ownership of
+// the linked image.
+static bool link_rom(ObjectFile* objects, int object_count, const char* output_path, const char* debug_path, uint8_t** image_out, int* image_size_out) {
+    uint8_t* image;
+    int image_size;
+    bool success = link_objects(objects, object_count, &image, &image_size);
+
+    if (success && !write_file_atomic(output_path, image, image_size)) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "could not write '%s'", output_path);
+        success = false;
+    }
+
+    if (success && debug_path != NULL) {
+        int* bases = malloc((object_count > 0 ? object_count : 1) * sizeof(int));
+        place_objects(objects, object_count, bases);
+        success = write_debug_info(debug_path, objects, bases, object_count);
+        free(bases);
+    }
+
+    if (success && image_out != NULL) {
+        *image_out = image;
+        *image_size_out = image_size;
+    }
+    else {
+        free(image);
+    }
+    return success;
+}
+
+// Loads (or assembles) every input and links them into a ROM
+static bool build_rom(char** inputs, int input_count, const char* output_path, const char* debug_path, const ParseOptions* options, const char* cache_directory, uint8_t** image_out, int* image_size_out) {
+    ObjectFile* objects = calloc(input_count, sizeof(ObjectFile));
+    bool relocatable = input_count > 1;
+    bool success = true;
+
+    for (int i = 0; i < input_count && success; i++) {
+        success = load_input(inputs[i], relocatable, options, cache_directory, &objects[i]);
+    }
 
     if (success) {
-        printf("\nOpcodes:\n");
-        for (int i = 0; i < opcode_array.count; i++) {
-            printf("Opcode %d (offset 0x%03X): 0x%04X\n", i, opcode_array.opcodes[i].memory_offset, opcode_array.opcodes[i].value);
+        success = link_rom(objects, input_count, output_path, debug_path, image_out, image_size_out);
+    }
+
+    for (int i = 0; i < input_count; i++) {
+        free_object(&objects[i]);
+    }
+    free(objects);
+    return success;
+}
+
+static double elapsed_ms(const struct timespec* start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Builds the ROM and rebuilds it whenever an input changes. The objects of all inputs
+// stay in memory; a changed input is only reassembled if its content differs, then
+// everything is relinked. A failed input keeps the ROM as it was until it is fixed.
+static bool watch_rom(char** inputs, int input_count, const char* output_path, const char* debug_path, const ParseOptions* options, const char* cache_directory) {
+    ObjectFile* objects = calloc(input_count, sizeof(ObjectFile));
+    bool* valid = calloc(input_count, sizeof(bool));
+    bool* changed = calloc(input_count, sizeof(bool));
+    bool relocatable = input_count > 1;
+    bool all_valid = true;
+
+    for (int i = 0; i < input_count; i++) {
+        valid[i] = load_input(inputs[i], relocatable, options, cache_directory, &objects[i]);
+        all_valid &= valid[i];
+    }
+    if (all_valid && link_rom(objects, input_count, output_path, debug_path, NULL, NULL)) {
+        printf("%s built\n", output_path);
+    }
+
+    Watcher* watcher = create_watcher(inputs, input_count);
+    flush_diagnostics();
+    if (watcher != NULL) {
+        printf("Watching %d input(s), press Ctrl+C to stop\n", input_count);
+        fflush(stdout);
+    }
+
+    while (watcher != NULL && wait_for_changes(watcher, changed)) {
+        struct timespec start;
+        timespec_get(&start, TIME_UTC);
+
+        bool rebuild = false;
+        for (int i = 0; i < input_count; i++) {
+            if (!changed[i]) {
+                continue;
+            }
+
+            size_t size;
+            char* data = read_file(inputs[i], &size);
+            if (data == NULL) {
+                continue; // Removed for a moment while being saved, a later event follows
+            }
+
+            // Saved without a change in content
+            if (valid[i] && !is_object_file(data, size) && hash_string(data) == objects[i].source_hash) {
+                free(data);
+                continue;
+            }
+
+            ObjectFile object;
+            bool success;
+            if (is_object_file(data, size)) {
+                success = deserialize_object((const uint8_t*)data, size, inputs[i], &object);
+            }
+            else {
+                success = assemble_cached(cache_directory, data, size, inputs[i], relocatable, options, &object);
+            }
+            free(data);
+
+            if (success) {
+                free_object(&objects[i]);
+                objects[i] = object;
+            }
+            valid[i] = success;
+            rebuild = true;
+        }
+
+        all_valid = true;
+        for (int i = 0; i < input_count; i++) {
+            all_valid &= valid[i];
+        }
+        if (rebuild && all_valid && link_rom(objects, input_count, output_path, debug_path, NULL, NULL)) {
+            printf("%s rebuilt in %.2f ms\n", output_path, elapsed_ms(&start));
+        }
+        flush_diagnostics();
+        fflush(stdout);
+    }
+
+    if (watcher != NULL) {
+        free_watcher(watcher);
+    }
+    for (int i = 0; i < input_count; i++) {
+        free_object(&objects[i]);
+    }
+    free(objects);
+    free(valid);
+    free(changed);
+    return false;
+}
+
+// Script lines: "seed frame:keys frame:keys ...", keys is a bit mask of held keys.
+// Returns the number of lanes read; events of all lanes are stored in one array.
+static int load_lane_scripts(const char* path, LaneConfig** configs, KeyEvent** events) {
+    char* text = read_file(path, NULL);
+    if (text == NULL) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "could not read '%s'", path);
+        return -1;
+    }
+
+    int lane_count = 0;
+    int event_count = 0;
+    int lane_capacity = 16;
+    int event_capacity = 64;
+    *configs = malloc(lane_capacity * sizeof(LaneConfig));
+    *events = malloc(event_capacity * sizeof(KeyEvent));
+
+    // Event counts first, pointers are fixed up once the event array stops moving
+    char* line = strtok(text, "\n");
+    while (line != NULL) {
+        char* cursor = line;
+        while (*cursor == ' ' || *cursor == '\t') {
+            cursor++;
+        }
+        if (*cursor != '\0' && *cursor != '#' && *cursor != '\r') {
+            if (lane_count >= lane_capacity) {
+                lane_capacity *= 2;
+                *configs = realloc(*configs, lane_capacity * sizeof(LaneConfig));
+            }
+            LaneConfig* config = &(*configs)[lane_count++];
+            config->seed = (uint32_t)strtoul(cursor, &cursor, 0);
+            config->events = NULL;
+            config->event_count = 0;
+
+            for (;;) {
+                char* end;
+                long frame = strtol(cursor, &end, 0);
+                if (end == cursor || *end != ':') {
+                    break;
+                }
+                cursor = end + 1;
+                if (event_count >= event_capacity) {
+                    event_capacity *= 2;
+                    *events = realloc(*events, event_capacity * sizeof(KeyEvent));
+                }
+                (*events)[event_count].frame = (int)frame;
+                (*events)[event_count].keys = (uint16_t)strtoul(cursor, &cursor, 0);
+                event_count++;
+                config->event_count++;
+            }
+        }
+        line = strtok(NULL, "\n");
+    }
+
+    int first_event = 0;
+    for (int i = 0; i < lane_count; i++) {
+        (*configs)[i].events = *events + first_event;
+        first_event += (*configs)[i].event_count;
+    }
+
+    free(text);
+    return lane_count;
+}
+
+typedef struct {
+    uint32_t hash;
+    int lane;
+} LaneOrder;
+
+static int compare_lane_order(const void* a, const void* b) {
+    const LaneOrder* left = a;
+    const LaneOrder* right = b;
+    if (left->hash != right->hash) {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    return left->lane - right->lane;
+}
+
+// Describes address as "file:line, label+offset" from the debug info, if there is any
+static void print_source_location(const DebugInfo* info, int address) {
+    if (info == NULL) {
+        return;
+    }
+
+    const char* file;
+    int line;
+    int symbol_address;
+    const char* symbol = lookup_symbol(info, address, &symbol_address);
+    if (lookup_line(info, address, &file, &line)) {
+        printf(" in %s:%d", file, line);
+    }
+    if (symbol != NULL) {
+        printf(symbol_address == address ? " at %s" : " at %s+%d", symbol, address - symbol_address);
+    }
+}
+
+static bool run_rom(const uint8_t* image, int image_size, const RunOptions* run, const char* debug_path) {
+    LaneConfig* configs = NULL;
+    KeyEvent* events = NULL;
+    int script_lanes = 0;
+
+    if (image_size > MACHINE_MAX_IMAGE_SIZE) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_OUT_OF_RANGE, NULL, 0, 0, "ROM of %d bytes does not fit the memory of --run (at most %d bytes)", image_size, MACHINE_MAX_IMAGE_SIZE);
+        return false;
+    }
+
+    if (run->script_path != NULL) {
+        script_lanes = load_lane_scripts(run->script_path, &configs, &events);
+        if (script_lanes < 0) {
+            return false;
+        }
+    }
+
+    // Lanes without a script line get no input and a seed derived from their index
+    int lane_count = run->lanes > script_lanes ? run->lanes : script_lanes;
+    configs = realloc(configs, (lane_count > 0 ? lane_count : 1) * sizeof(LaneConfig));
+    for (int i = script_lanes; i < lane_count; i++) {
+        configs[i].seed = (uint32_t)i + 1;
+        configs[i].events = NULL;
+        configs[i].event_count = 0;
+    }
+
+    LaneResult* results = malloc((lane_count > 0 ? lane_count : 1) * sizeof(LaneResult));
+    run_lockstep(image, image_size, configs, lane_count, run->frames, run->cycles_per_frame, results);
+
+    DebugInfo debug_info;
+    size_t debug_size = 0;
+    const void* debug_data = debug_path != NULL ? map_file(debug_path, &debug_size) : NULL;
+    bool has_debug_info = debug_data != NULL && open_debug_info(debug_data, debug_size, &debug_info);
+
+    int faulted = 0;
+    for (int i = 0; i < lane_count; i++) {
+        if (results[i].faulted) {
+            printf("lane %d: faulted at 0x%03X (opcode 0x%04X)", i, results[i].pc, results[i].opcode);
+            print_source_location(has_debug_info ? &debug_info : NULL, results[i].pc);
+            printf("\n");
+            faulted++;
+        }
+    }
+    if (debug_data != NULL) {
+        unmap_file(debug_data, debug_size);
+    }
+
+    // Group lanes with identical framebuffers, sorted by hash then lane
+    LaneOrder* order = malloc((lane_count > 0 ? lane_count : 1) * sizeof(LaneOrder));
+    for (int i = 0; i < lane_count; i++) {
+        order[i].hash = results[i].framebuffer_hash;
+        order[i].lane = i;
+    }
+    qsort(order, lane_count, sizeof(LaneOrder), compare_lane_order);
+
+    for (int i = 0; i < lane_count;) {
+        int end = i + 1;
+        while (end < lane_count && order[end].hash == order[i].hash) {
+            end++;
+        }
+        printf("framebuffer %08X: %d lane(s), first lane %d\n", order[i].hash, end - i, order[i].lane);
+        i = end;
+    }
+    printf("%d lane(s), %d faulted\n", lane_count, faulted);
+
+    free(order);
+    free(results);
+    free(configs);
+    free(events);
+    return faulted == 0;
+}
+
+int main(int argc, char** argv) {
+    bool compile_only = false;
+    const char* output_path = NULL;
+    const char* cache_directory = NULL;
+    bool watch = false;
+    bool debug_info = false;
+    DiagnosticsFormat diagnostics_format = DIAGNOSTICS_TEXT;
+    int max_errors = 100;
+    ParseOptions options;
+    options.target = TARGET_CHIP8;
+    options.print_map = false;
+    options.dedup = false;
+    options.superopt_table = NULL;
+    RunOptions run;
+    run.lanes = 0;
+    run.frames = 600;
+    run.cycles_per_frame = 10;
+    run.script_path = NULL;
+    char** inputs = malloc(argc * sizeof(char*));
+    int input_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            compile_only = true;
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+            const char* target = argv[++i];
+            if (strcmp(target, "chip8") == 0) {
+                options.target = TARGET_CHIP8;
+            }
+            else if (strcmp(target, "schip") == 0) {
+                options.target = TARGET_SCHIP;
+            }
+            else if (strcmp(target, "xochip") == 0) {
+                options.target = TARGET_XOCHIP;
+            }
+            else {
+                printf("Error: unknown target '%s'\n", target);
+                free(inputs);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--max-errors") == 0 && i + 1 < argc) {
+            max_errors = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--diagnostics") == 0 && i + 1 < argc) {
+            const char* format = argv[++i];
+            if (strcmp(format, "json") == 0) {
+                diagnostics_format = DIAGNOSTICS_JSON;
+            }
+            else if (strcmp(format, "text") == 0) {
+                diagnostics_format = DIAGNOSTICS_TEXT;
+            }
+            else {
+                printf("Error: unknown diagnostics format '%s'\n", format);
+                free(inputs);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--watch") == 0) {
+            watch = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_directory = argv[++i];
+        }
+        else if (strcmp(argv[i], "--dedup") == 0) {
+            options.dedup = true;
+        }
+        else if (strcmp(argv[i], "-g") == 0) {
+            debug_info = true;
+        }
+        else if (strcmp(argv[i], "--superopt") == 0 && i + 1 < argc) {
+            options.superopt_table = argv[++i];
+        }
+        else if (strcmp(argv[i], "--map") == 0) {
+            options.print_map = true;
+        }
+        else if (strcmp(argv[i], "--run") == 0 && i + 1 < argc) {
+            run.lanes = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            run.frames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            run.cycles_per_frame = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            run.script_path = argv[++i];
+        }
+        else if (argv[i][0] == '-') {
+            printf("Error: unknown option '%s'\n", argv[i]);
+            print_usage();
+            free(inputs);
+            return 1;
+        }
+        else {
+            inputs[input_count++] = argv[i];
+        }
+    }
+
+    configure_diagnostics(diagnostics_format, max_errors);
+
+    if (input_count == 0) {
+        print_usage();
+        free(inputs);
+        return 1;
+    }
+
+    bool success = true;
+
+    if (watch && (compile_only || run.lanes > 0 || run.script_path != NULL)) {
+        printf("Error: --watch cannot be combined with -c or --run\n");
+        free(inputs);
+        return 1;
+    }
+
+    if (watch) {
+        char* rom_path = output_path != NULL ? NULL : replace_extension(inputs[0], ".ch8");
+        char* debug_path = debug_info ? replace_extension(output_path != NULL ? output_path : rom_path, ".dbg") : NULL;
+        success = watch_rom(inputs, input_count, output_path != NULL ? output_path : rom_path, debug_path, &options, cache_directory);
+        free(debug_path);
+        free(rom_path);
+    }
+    else if (compile_only) {
+        if (output_path != NULL && input_count > 1) {
+            printf("Error: -o cannot be used with -c and multiple inputs\n");
+            free(inputs);
+            return 1;
+        }
+        for (int i = 0; i < input_count; i++) {
+            char* object_path = output_path != NULL ? NULL : replace_extension(inputs[i], ".o");
+            success &= compile_source(inputs[i], output_path != NULL ? output_path : object_path, &options, cache_directory);
+            free(object_path);
         }
     }
+    else {
+        char* rom_path = output_path != NULL ? NULL : replace_extension(inputs[0], ".ch8");
+        bool run_requested = run.lanes > 0 || run.script_path != NULL;
+        uint8_t* image = NULL;
+        int image_size = 0;
 
-    // Free memory
-    free_token_array(&token_array);
-    free_opcode_array(&opcode_array);
+        char* debug_path = debug_info ? replace_extension(output_path != NULL ? output_path : rom_path, ".dbg") : NULL;
+
+        success = build_rom(inputs, input_count, output_path != NULL ? output_path : rom_path, debug_path, &options, cache_directory, run_requested ? &image : NULL, &image_size);
+        free(rom_path);
+
+        if (success && run_requested) {
+            success = run_rom(image, image_size, &run, debug_path);
+        }
+        free(debug_path);
+        free(image);
+    }
 
-    getchar();
-    return 0;
-}
\ No newline at end of file
+    flush_diagnostics();
+    free(inputs);
+    return success ? 0 : 1;
+}
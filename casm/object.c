@@ -0,0 +1,497 @@
+#if defined(_MSC_VER) || defined(__STDC_LIB_EXT1__)
+#define _CRT_SECURE_NO_WARNINGS
+#pragma warning(disable: 4996)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "lexer.h"
+#include "parser.h"
+#include "object.h"
+#include "diagnostics.h"
+
+#define OBJECT_HEADER_SIZE 24
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t position;
+    bool overflow;
+} ByteReader;
+
+static void put_bytes(ByteBuffer* buffer, const void* data, size_t size);
+static void put_u8(ByteBuffer* buffer, uint8_t value);
+static void put_u16(ByteBuffer* buffer, uint16_t value);
+static void put_u32(ByteBuffer* buffer, uint32_t value);
+static void put_name(ByteBuffer* buffer, const char* name);
+static uint8_t get_u8(ByteReader* reader);
+static uint16_t get_u16(ByteReader* reader);
+static uint32_t get_u32(ByteReader* reader);
+static void get_name(ByteReader* reader, char* name);
+static char* get_string(ByteReader* reader);
+static int find_import(ObjectFile* object, const char* name);
+static void build_line_table(ObjectFile* object, OpcodeArray* opcode_array, TokenArray* token_array);
+static int compare_opcode_offset(const void* a, const void* b);
+static uint8_t object_options(const ParseOptions* options);
+
+bool assemble_object(const char* source, const char* filename, bool relocatable, const ParseOptions* options, ObjectFile* object) {
+    memset(object, 0, sizeof(ObjectFile));
+    object->origin = 0x200;
+    object->source_hash = hash_string(source);
+    object->target = options->target;
+    object->options = object_options(options);
+
+    TokenArray token_array = tokenize(source, filename);
+    OpcodeArray opcode_array;
+    RelocationArray relocation_array;
+    bool success;
+    if (relocatable) {
+        success = parse_relocatable(&token_array, options, &opcode_array, &relocation_array);
+    }
+    else {
+        success = parse(&token_array, options, &opcode_array);
+        relocation_array.relocations = NULL;
+        relocation_array.count = 0;
+    }
+
+    if (success) {
+        // ORG and sections may leave gaps, which are zero filled
+        object->code_size = 0;
+        for (int i = 0; i < opcode_array.count; i++) {
+            int end = opcode_array.opcodes[i].memory_offset + opcode_array.opcodes[i].size - object->origin;
+            if (end > object->code_size) {
+                object->code_size = end;
+            }
+        }
+
+        object->code = calloc(object->code_size > 0 ? object->code_size : 1, 1);
+        for (int i = 0; i < opcode_array.count; i++) {
+            Opcode* opcode = &opcode_array.opcodes[i];
+            uint8_t* code = object->code + (opcode->memory_offset - object->origin);
+            if (opcode->size == 1) {
+                code[0] = opcode->value & 0xFF;
+            }
+            else {
+                code[0] = opcode->value >> 8;
+                code[1] = opcode->value & 0xFF;
+            }
+        }
+
+        const LabelDefinition* labels;
+        int label_count = get_label_definitions(&labels);
+        object->exports = malloc((label_count > 0 ? label_count : 1) * sizeof(ObjectSymbol));
+        object->locals = malloc((label_count > 0 ? label_count : 1) * sizeof(ObjectSymbol));
+        for (int i = 0; i < label_count; i++) {
+            ObjectSymbol* symbol = labels[i].global ? &object->exports[object->export_count++] : &object->locals[object->local_count++];
+            strcpy(symbol->name, labels[i].name);
+            symbol->hash = hash_string(labels[i].name);
+            symbol->address = (uint16_t)labels[i].memory_offset;
+        }
+
+        int relocation_count = relocation_array.count;
+        object->imports = malloc((relocation_count > 0 ? relocation_count : 1) * sizeof(ObjectSymbol));
+        object->relocations = malloc((relocation_count > 0 ? relocation_count : 1) * sizeof(ObjectRelocation));
+        object->relocation_count = relocation_count;
+        for (int i = 0; i < relocation_count; i++) {
+            Relocation* relocation = &relocation_array.relocations[i];
+            object->relocations[i].offset = (uint16_t)(relocation->memory_offset - object->origin);
+            object->relocations[i].kind = (uint8_t)relocation->kind;
+
+            if (relocation->symbol[0] == '\0') {
+                object->relocations[i].symbol = OBJECT_LOCAL_SYMBOL;
+                continue;
+            }
+
+            int import_index = find_import(object, relocation->symbol);
+            if (import_index == -1) {
+                import_index = object->import_count++;
+                strcpy(object->imports[import_index].name, relocation->symbol);
+                object->imports[import_index].hash = hash_string(relocation->symbol);
+                object->imports[import_index].address = 0;
+            }
+            object->relocations[i].symbol = (uint16_t)import_index;
+        }
+
+        object->source_name = malloc(strlen(filename) + 1);
+        strcpy(object->source_name, filename);
+        build_line_table(object, &opcode_array, &token_array);
+
+        get_optimization_stats(&object->stats);
+    }
+
+    free_token_array(&token_array);
+    free_opcode_array(&opcode_array);
+    free_relocation_array(&relocation_array);
+
+    return success;
+}
+
+bool write_object(const char* path, ObjectFile* object) {
+    uint8_t* data;
+    size_t size;
+    serialize_object(object, &data, &size);
+
+    bool success = write_file(path, data, size);
+    free(data);
+    return success;
+}
+
+void serialize_object(const ObjectFile* object, uint8_t** data, size_t* size) {
+    ByteBuffer buffer;
+    buffer.size = 0;
+    buffer.capacity = OBJECT_HEADER_SIZE + object->code_size + 64;
+    buffer.data = malloc(buffer.capacity);
+
+    put_bytes(&buffer, OBJECT_MAGIC, 4);
+    put_u16(&buffer, OBJECT_VERSION);
+    put_u16(&buffer, object->origin);
+    put_u32(&buffer, object->source_hash);
+    put_u8(&buffer, (uint8_t)object->target);
+    put_u8(&buffer, object->options);
+    put_u16(&buffer, (uint16_t)object->code_size);
+    put_u16(&buffer, (uint16_t)object->export_count);
+    put_u16(&buffer, (uint16_t)object->local_count);
+    put_u16(&buffer, (uint16_t)object->import_count);
+    put_u16(&buffer, (uint16_t)object->relocation_count);
+    put_bytes(&buffer, object->code, object->code_size);
+
+    for (int i = 0; i < object->export_count; i++) {
+        put_u32(&buffer, object->exports[i].hash);
+        put_u16(&buffer, object->exports[i].address);
+        put_name(&buffer, object->exports[i].name);
+    }
+    for (int i = 0; i < object->local_count; i++) {
+        put_u32(&buffer, object->locals[i].hash);
+        put_u16(&buffer, object->locals[i].address);
+        put_name(&buffer, object->locals[i].name);
+    }
+    for (int i = 0; i < object->import_count; i++) {
+        put_u32(&buffer, object->imports[i].hash);
+        put_name(&buffer, object->imports[i].name);
+    }
+    for (int i = 0; i < object->relocation_count; i++) {
+        put_u16(&buffer, object->relocations[i].offset);
+        put_u16(&buffer, object->relocations[i].symbol);
+        put_u8(&buffer, object->relocations[i].kind);
+    }
+
+    const char* source_name = object->source_name != NULL ? object->source_name : "";
+    put_u16(&buffer, (uint16_t)strlen(source_name));
+    put_bytes(&buffer, source_name, strlen(source_name));
+    put_u32(&buffer, (uint32_t)object->line_count);
+    for (int i = 0; i < object->line_count; i++) {
+        put_u16(&buffer, object->lines[i].offset);
+        put_u32(&buffer, object->lines[i].line);
+    }
+
+    const OptimizationStats* stats = &object->stats;
+    put_u16(&buffer, (uint16_t)stats->data_blocks_merged);
+    put_u16(&buffer, (uint16_t)stats->data_bytes_saved);
+    put_u16(&buffer, (uint16_t)stats->windows);
+    put_u16(&buffer, (uint16_t)stats->windows_rewritten);
+    put_u16(&buffer, (uint16_t)stats->window_bytes_saved);
+    put_u16(&buffer, (uint16_t)stats->windows_searched);
+
+    *data = buffer.data;
+    *size = buffer.size;
+}
+
+bool is_object_file(const char* data, size_t size) {
+    return size >= OBJECT_HEADER_SIZE && memcmp(data, OBJECT_MAGIC, 4) == 0;
+}
+
+bool read_object(const char* path, ObjectFile* object) {
+    memset(object, 0, sizeof(ObjectFile));
+
+    size_t size;
+    char* data = read_file(path, &size);
+    if (data == NULL) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "could not read object file '%s'", path);
+        return false;
+    }
+
+    bool success = deserialize_object((const uint8_t*)data, size, path, object);
+    free(data);
+    return success;
+}
+
+bool deserialize_object(const uint8_t* data, size_t size, const char* name, ObjectFile* object) {
+    memset(object, 0, sizeof(ObjectFile));
+
+    if (!is_object_file((const char*)data, size)) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "'%s' is not an object file", name);
+        return false;
+    }
+
+    ByteReader reader;
+    reader.data = data;
+    reader.size = size;
+    reader.position = 4;
+    reader.overflow = false;
+
+    uint16_t version = get_u16(&reader);
+    if (version != OBJECT_VERSION) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "object file '%s' has unsupported version %d", name, version);
+        return false;
+    }
+
+    object->origin = get_u16(&reader);
+    object->source_hash = get_u32(&reader);
+    object->target = (Target)get_u8(&reader);
+    object->options = get_u8(&reader);
+    object->code_size = get_u16(&reader);
+    object->export_count = get_u16(&reader);
+    object->local_count = get_u16(&reader);
+    object->import_count = get_u16(&reader);
+    object->relocation_count = get_u16(&reader);
+
+    object->code = malloc(object->code_size > 0 ? object->code_size : 1);
+    object->exports = malloc((object->export_count > 0 ? object->export_count : 1) * sizeof(ObjectSymbol));
+    object->locals = malloc((object->local_count > 0 ? object->local_count : 1) * sizeof(ObjectSymbol));
+    object->imports = malloc((object->import_count > 0 ? object->import_count : 1) * sizeof(ObjectSymbol));
+    object->relocations = malloc((object->relocation_count > 0 ? object->relocation_count : 1) * sizeof(ObjectRelocation));
+
+    for (int i = 0; i < object->code_size; i++) {
+        object->code[i] = get_u8(&reader);
+    }
+    for (int i = 0; i < object->export_count; i++) {
+        object->exports[i].hash = get_u32(&reader);
+        object->exports[i].address = get_u16(&reader);
+        get_name(&reader, object->exports[i].name);
+    }
+    for (int i = 0; i < object->local_count; i++) {
+        object->locals[i].hash = get_u32(&reader);
+        object->locals[i].address = get_u16(&reader);
+        get_name(&reader, object->locals[i].name);
+    }
+    for (int i = 0; i < object->import_count; i++) {
+        object->imports[i].hash = get_u32(&reader);
+        object->imports[i].address = 0;
+        get_name(&reader, object->imports[i].name);
+    }
+    for (int i = 0; i < object->relocation_count; i++) {
+        object->relocations[i].offset = get_u16(&reader);
+        object->relocations[i].symbol = get_u16(&reader);
+        object->relocations[i].kind = get_u8(&reader);
+    }
+
+    object->source_name = get_string(&reader);
+    object->line_count = (int)get_u32(&reader);
+    if (reader.overflow || (size_t)object->line_count > (reader.size - reader.position) / 6) {
+        object->line_count = 0;
+        reader.overflow = true;
+    }
+    object->lines = malloc((object->line_count > 0 ? object->line_count : 1) * sizeof(ObjectLine));
+    for (int i = 0; i < object->line_count; i++) {
+        object->lines[i].offset = get_u16(&reader);
+        object->lines[i].line = get_u32(&reader);
+    }
+
+    OptimizationStats* stats = &object->stats;
+    stats->data_blocks_merged = get_u16(&reader);
+    stats->data_bytes_saved = get_u16(&reader);
+    stats->windows = get_u16(&reader);
+    stats->windows_rewritten = get_u16(&reader);
+    stats->window_bytes_saved = get_u16(&reader);
+    stats->windows_searched = get_u16(&reader);
+
+    if (reader.overflow) {
+        report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "object file '%s' is truncated", name);
+        free_object(object);
+        return false;
+    }
+
+    return true;
+}
+
+bool read_object_header(const char* path, ObjectFile* object) {
+    memset(object, 0, sizeof(ObjectFile));
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    uint8_t header[OBJECT_HEADER_SIZE];
+    size_t read = fread(header, 1, sizeof(header), file);
+    fclose(file);
+
+    if (!is_object_file((const char*)header, read) || (header[4] | (header[5] << 8)) != OBJECT_VERSION) {
+        return false;
+    }
+
+    object->origin = header[6] | (header[7] << 8);
+    object->source_hash = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t)header[11] << 24);
+    object->target = (Target)header[12];
+    object->options = header[13];
+    return true;
+}
+
+bool object_matches(const ObjectFile* object, const char* source, const ParseOptions* options) {
+    return object->source_hash == hash_string(source) && object->target == options->target && object->options == object_options(options);
+}
+
+void free_object(ObjectFile* object) {
+    free(object->code);
+    free(object->exports);
+    free(object->locals);
+    free(object->imports);
+    free(object->relocations);
+    free(object->source_name);
+    free(object->lines);
+    memset(object, 0, sizeof(ObjectFile));
+}
+
+// One entry per run of code from the same source line, in address order. Gaps left by
+// ORG and sections get an entry with line 0.
+static void build_line_table(ObjectFile* object, OpcodeArray* opcode_array, TokenArray* token_array) {
+    Opcode* opcodes = malloc((opcode_array->count > 0 ? opcode_array->count : 1) * sizeof(Opcode));
+    memcpy(opcodes, opcode_array->opcodes, opcode_array->count * sizeof(Opcode));
+    qsort(opcodes, opcode_array->count, sizeof(Opcode), compare_opcode_offset);
+
+    int capacity = 16;
+    object->lines = malloc(capacity * sizeof(ObjectLine));
+    object->line_count = 0;
+
+    int previous_end = -1;
+    int previous_line = -1;
+    for (int i = 0; i < opcode_array->count; i++) {
+        int offset = opcodes[i].memory_offset - object->origin;
+        int line;
+        int column;
+        resolve_location(token_array, opcodes[i].source_offset, &line, &column);
+
+        // Two entries at most: one closing a gap and one starting the line
+        if (object->line_count + 2 > capacity) {
+            capacity *= 2;
+            object->lines = realloc(object->lines, capacity * sizeof(ObjectLine));
+        }
+        if (previous_end != -1 && previous_end != offset) {
+            object->lines[object->line_count].offset = (uint16_t)previous_end;
+            object->lines[object->line_count].line = 0;
+            object->line_count++;
+            previous_line = 0;
+        }
+        if (line != previous_line) {
+            object->lines[object->line_count].offset = (uint16_t)offset;
+            object->lines[object->line_count].line = (uint32_t)line;
+            object->line_count++;
+            previous_line = line;
+        }
+        previous_end = offset + opcodes[i].size;
+    }
+
+    free(opcodes);
+}
+
+static uint8_t object_options(const ParseOptions* options) {
+    uint8_t bits = 0;
+    if (options->dedup) {
+        bits |= OBJECT_OPTION_DEDUP;
+    }
+    if (options->superopt_table != NULL) {
+        bits |= OBJECT_OPTION_SUPEROPT;
+    }
+    return bits;
+}
+
+static int compare_opcode_offset(const void* a, const void* b) {
+    return ((const Opcode*)a)->memory_offset - ((const Opcode*)b)->memory_offset;
+}
+
+static int find_import(ObjectFile* object, const char* name) {
+    for (int i = 0; i < object->import_count; i++) {
+        if (strcmp(object->imports[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*********************************************************************************
+* Serialization helpers
+*********************************************************************************/
+
+static void put_bytes(ByteBuffer* buffer, const void* data, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        while (buffer->size + size > buffer->capacity) {
+            buffer->capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void put_u8(ByteBuffer* buffer, uint8_t value) {
+    put_bytes(buffer, &value, 1);
+}
+
+static void put_u16(ByteBuffer* buffer, uint16_t value) {
+    uint8_t bytes[2] = { value & 0xFF, value >> 8 };
+    put_bytes(buffer, bytes, 2);
+}
+
+static void put_u32(ByteBuffer* buffer, uint32_t value) {
+    uint8_t bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24 };
+    put_bytes(buffer, bytes, 4);
+}
+
+static void put_name(ByteBuffer* buffer, const char* name) {
+    uint8_t length = (uint8_t)strlen(name);
+    put_u8(buffer, length);
+    put_bytes(buffer, name, length);
+}
+
+static uint8_t get_u8(ByteReader* reader) {
+    if (reader->position >= reader->size) {
+        reader->overflow = true;
+        return 0;
+    }
+    return reader->data[reader->position++];
+}
+
+static uint16_t get_u16(ByteReader* reader) {
+    uint16_t value = get_u8(reader);
+    return value | (get_u8(reader) << 8);
+}
+
+static uint32_t get_u32(ByteReader* reader) {
+    uint32_t value = get_u16(reader);
+    return value | ((uint32_t)get_u16(reader) << 16);
+}
+
+static void get_name(ByteReader* reader, char* name) {
+    uint8_t length = get_u8(reader);
+    for (int i = 0; i < length; i++) {
+        char c = (char)get_u8(reader);
+        if (i < MAX_LABEL_LENGTH - 1) {
+            name[i] = c;
+        }
+    }
+    name[length < MAX_LABEL_LENGTH - 1 ? length : MAX_LABEL_LENGTH - 1] = '\0';
+}
+
+static char* get_string(ByteReader* reader) {
+    uint16_t length = get_u16(reader);
+    if (length > reader->size - reader->position) {
+        length = 0;
+        reader->overflow = true;
+    }
+
+    char* str = malloc(length + 1);
+    for (int i = 0; i < length; i++) {
+        str[i] = (char)get_u8(reader);
+    }
+    str[length] = '\0';
+    return str;
+}
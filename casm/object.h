@@ -0,0 +1,96 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parser.h"
+
+/*
+* Relocatable object file (produced by 'casm -c'), all integers little endian:
+*
+*   char[4]  magic "CASM"
+*   u16      version
+*   u16      origin            address the code was assembled at
+*   u32      source hash       content hash of the source, used to skip reassembly
+*   u8       target            Target the source was assembled for
+*   u8       options           OBJECT_OPTION_ bits the source was assembled with
+*   u16      code size
+*   u16      export count
+*   u16      local count
+*   u16      import count
+*   u16      relocation count
+*   u8[]     code              big endian opcodes
+*   exports: u32 hash, u16 address, u8 name length, name
+*   locals:  u32 hash, u16 address, u8 name length, name
+*   imports: u32 hash, u8 name length, name
+*   relocs:  u16 code offset, u16 import index (OBJECT_LOCAL_SYMBOL for local labels), u8 RelocationKind
+*   u16      source name length, source name
+*   u32      line count
+*   lines:   u16 code offset, u32 line (0 for gaps), each covering the code up to the next one
+*   u16[6]   OptimizationStats fields, in declaration order
+*/
+
+#define OBJECT_MAGIC "CASM"
+#define OBJECT_VERSION 6
+#define OBJECT_LOCAL_SYMBOL 0xFFFF
+
+// Options that change the code generated for a source
+#define OBJECT_OPTION_DEDUP 1
+#define OBJECT_OPTION_SUPEROPT 2
+
+typedef struct {
+    char name[MAX_LABEL_LENGTH];
+    uint32_t hash;
+    uint16_t address;
+} ObjectSymbol;
+
+typedef struct {
+    uint16_t offset;
+    uint16_t symbol;
+    uint8_t kind;
+} ObjectRelocation;
+
+typedef struct {
+    uint16_t offset;
+    uint32_t line;
+} ObjectLine;
+
+typedef struct {
+    uint16_t origin;
+    uint32_t source_hash;
+    Target target;
+    uint8_t options;
+    uint8_t* code;
+    int code_size;
+    ObjectSymbol* exports;          // labels declared GLOBAL, visible to other objects
+    int export_count;
+    ObjectSymbol* locals;           // all other labels, only kept for debug info
+    int local_count;
+    ObjectSymbol* imports;
+    int import_count;
+    ObjectRelocation* relocations;
+    int relocation_count;
+    char* source_name;
+    ObjectLine* lines;
+    int line_count;
+    OptimizationStats stats;
+} ObjectFile;
+
+// Assembles source into an object. Non relocatable objects must be linked on their own,
+// relocatable objects may reference labels defined in other objects.
+bool assemble_object(const char* source, const char* filename, bool relocatable, const ParseOptions* options, ObjectFile* object);
+bool write_object(const char* path, ObjectFile* object);
+bool read_object(const char* path, ObjectFile* object);
+// In memory form of the object file format. name is only used in error messages.
+void serialize_object(const ObjectFile* object, uint8_t** data, size_t* size);
+bool deserialize_object(const uint8_t* data, size_t size, const char* name, ObjectFile* object);
+bool is_object_file(const char* data, size_t size);
+// Reads only the header fields, the object holds no data and needs no free_object
+bool read_object_header(const char* path, ObjectFile* object);
+// Returns whether object was assembled from source with the same target and options
+bool object_matches(const ObjectFile* object, const char* source, const ParseOptions* options);
+void free_object(ObjectFile* object);
+
+#endif // !OBJECT_H
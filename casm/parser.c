@@ -1,52 +1,281 @@
 #define _CRT_SECURE_NO_WARNINGS
 #pragma warning(disable: 4996)
 
+#include <ctype.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
+#include "util.h"
 #include "lexer.h"
 #include "parser.h"
-
+#include "expression.h"
+#include "diagnostics.h"
+#include "superopt.h"
+
+
+// Data block deduplication runs an extra first pass that only collects the data blocks,
+// merges them, then lays the program out again without the merged copies.
+typedef enum {
+    DEDUP_OFF,
+    DEDUP_SCAN,
+    DEDUP_APPLY,
+} DedupState;
+
+// The superoptimizer shares that first pass to collect its instruction windows
+typedef enum {
+    SUPEROPT_OFF,
+    SUPEROPT_SCAN,
+    SUPEROPT_APPLY,
+} SuperoptState;
 
 typedef struct {
+    TokenArray* token_array;
     Token* tokens;
     int position;
     int count;
     bool hasError;
+    int pass;                       // 1: collect label definitions, 2: emit opcodes
+    bool muted;                     // suppress diagnostics (first pass)
+    int memory_offset;              // memory offset of the instruction being parsed
+    bool relocatable;               // unresolved labels become imports instead of errors
+    RelocationArray* relocations;
+    Target target;
+    int max_address;
+    bool has_long_operand;          // the instruction is followed by a 16-bit operand word
+    uint16_t long_operand;
+    OpcodeArray* opcodes;
+    int rept_depth;
+    bool rept_first_iteration;      // every enclosing REPT is in its first iteration
+    int section;                    // index of the current section, -1 for ORG code
+    bool data;                      // parsing a DB/DW value, its field lives at memory_offset
+    bool overlap_reported;          // one overlap diagnostic per ORG block
+    bool silent;                    // no diagnostics at all (data block and window scan)
+    DedupState dedup;
+    bool operand_constant;          // the last operand did not depend on any address
+    int data_blocks_seen;           // data blocks opened in this pass
+    int data_block;                 // the open data block, -1 if none
+    bool eliding;                   // the open data block is merged into another one
+    int elided_size;                // bytes of the merged block seen so far
+    int first_pending_label;        // first label defined since the last emission, -1 if none
+    int errors;                     // errors reported so far
+    int error_offset;               // source offset of the last reported error
+    int error_line_end;             // end of the line of the last error, later errors on it are dropped
+    SuperoptState superopt;
+    const char* superopt_table;
+    int instructions_seen;          // instructions parsed in this pass
+    int window;                     // scan: the open window, -1 if none. Later: next window to apply
+    int elided_instructions;        // instructions of the applied window still to drop
+    bool after_skip;                // the last instruction was a skip
+    int windows_searched;           // windows the rewrite table had no entry for
 } Parser;
 
-#define MAX_LABELS 256
-typedef struct {
-    char name[32];
-    int memory_offset;
-} LabelDefinition;
+#define PROGRAM_START 0x200
+#define MAX_REPT_COUNT 0x10000
+#define MAX_REPT_DEPTH 16
 
-static LabelDefinition label_definitions[MAX_LABELS];
+// Label definitions in definition order, indexed by an open addressing hash table
+// holding label index + 1 (0 = empty slot)
+static LabelDefinition* label_definitions = NULL;
 static int label_definitions_count = 0;
+static int label_definitions_capacity = 0;
+static int* label_slots = NULL;
+static uint32_t label_slots_capacity = 0;
+
+// EQU/DEFINE constants, open addressing hash table
+typedef struct {
+    char name[MAX_LABEL_LENGTH];
+    uint32_t hash;
+    long value;
+    int label_weight;   // 1 if the constant is "label + constant"
+    long label_base;    // address of that label
+    int definition;     // token index of the definition, to detect redefinitions
+    int pass;           // pass in which the value was last evaluated
+    bool complete;      // false if the value depends on a symbol that was not yet defined
+    bool address_dependent;
+} Constant;
+
+static Constant* constants = NULL;
+static uint32_t constants_capacity = 0;
+static uint32_t constants_count = 0;
+
+// Named sections. Their size is measured in the first pass, then the placement pass
+// packs them into the memory left free by the ORG code.
+typedef struct {
+    char name[MAX_LABEL_LENGTH];
+    uint32_t hash;
+    int definition;     // token index of the first SECTION directive
+    int size;
+    int fill;           // bytes emitted so far in the current pass
+    int base;           // 0 until placed, so first pass offsets are section relative
+    int alignment;      // 2 once the section contains instructions
+} Section;
+
+static Section* sections = NULL;
+static int sections_count = 0;
+static int sections_capacity = 0;
+
+// Free space bitmap, one bit per byte of the address space (set = taken)
+static uint32_t* memory_map = NULL;
+static int memory_map_words = 0;
+
+// A run of DB/DW data up to the next label, instruction, ORG or SECTION directive.
+// Blocks that start at a label and only hold constant values can be merged into a
+// block that holds the same bytes (or ends with them), assuming the data is only
+// reached through its label.
+typedef struct {
+    int start;          // first byte in data_bytes
+    int size;
+    bool eligible;
+    int alias;          // block this one is merged into, -1 if it is kept
+    int alias_offset;   // offset of the merged bytes in that block
+    int memory_offset;  // address of the block in the current pass
+    int section;
+} DataBlock;
+
+// Label defined at offset in a merged block, moved to the surviving copy
+typedef struct {
+    int label;
+    int block;
+    int offset;
+} LabelAlias;
+
+static DataBlock* data_blocks = NULL;
+static int data_blocks_count = 0;
+static int data_blocks_capacity = 0;
+static uint8_t* data_bytes = NULL;
+static int data_bytes_count = 0;
+static int data_bytes_capacity = 0;
+static LabelAlias* label_aliases = NULL;
+static int label_aliases_count = 0;
+static int label_aliases_capacity = 0;
+
+// A run of register arithmetic that is only entered at its first instruction: no
+// label inside, not right after a skip, one contiguous address range. Windows are
+// numbered by the instructions before them, which is the same in every pass.
+typedef struct {
+    int first;          // number of the first instruction
+    int length;
+    uint16_t opcodes[SUPEROPT_MAX_WINDOW];
+    int rewrite_length;
+    uint16_t rewrite[SUPEROPT_MAX_WINDOW];
+    int memory_offset;  // address in the scan
+    int section;
+} Window;
+
+// Addresses from a $ expression to its value in the scan. Code in between may not
+// change size, the distance is fixed in the source.
+typedef struct {
+    int start;
+    int end;
+    int section;
+} LocationSpan;
+
+static Window* windows = NULL;
+static int windows_count = 0;
+static int windows_capacity = 0;
+static LocationSpan* location_spans = NULL;
+static int location_spans_count = 0;
+static int location_spans_capacity = 0;
+
+// Code changed by --dedup or --superopt, in final addresses. From first on the code no
+// longer holds what it held without the optimization, from end on it is shifted.
+typedef struct {
+    int first;
+    int end;
+    const char* option;
+} MovedRange;
 
-void error(const char* msg);
-static uint16_t parse_instruction(Parser* parser, int memory_offset);
-static void add_opcode(OpcodeArray* opcode_array, uint16_t opcode, int memory_offset);
-static uint16_t parse_register(Parser* parser);
-static uint16_t parse_immediate(Parser* parser);
-void collect_label_definitions(Parser* parser);
+// Second pass reference to an address that is not just a label. base is the label of
+// "label + constant" or -1 for an absolute address. For JP V0 tables target is -1.
+typedef struct {
+    int source_offset;
+    int base;
+    int target;
+} AddressReference;
+
+static MovedRange* moved_ranges = NULL;
+static int moved_ranges_count = 0;
+static int moved_ranges_capacity = 0;
+static AddressReference* address_references = NULL;
+static int address_references_count = 0;
+static int address_references_capacity = 0;
+
+static OptimizationStats optimization_stats;
+
+// Maximum values of the operand fields of an opcode
+#define FIELD_NIBBLE 0xF
+#define FIELD_BYTE 0xFF
+#define FIELD_ADDRESS 0xFFF
+#define FIELD_LONG_ADDRESS 0xFFFF
+
+static void error(Parser* parser, Token* token, DiagnosticCode code, const char* fmt, ...);
+static void warning(Parser* parser, int offset, DiagnosticCode code, const char* fmt, ...);
+static bool parse_program(TokenArray* token_array, const ParseOptions* options, OpcodeArray* opcode_array, RelocationArray* relocation_array);
+static void parse_statement(Parser* parser);
+static bool parse_instruction(Parser* parser, uint16_t* opcode);
+static void parse_rept(Parser* parser, Token* token);
+static int find_endr(Parser* parser, Token* token);
+static void parse_org(Parser* parser, Token* token);
+static void parse_section(Parser* parser, Token* token);
+static void parse_global(Parser* parser);
+static void parse_data(Parser* parser, Token* token, int size);
+static uint16_t parse_mnemonic(Parser* parser, Token* token);
+static void emit(Parser* parser, Token* token, uint16_t value, int size);
+static void enter_section(Parser* parser, int section, int memory_offset);
+static void reserve_memory(Parser* parser, Token* token, int memory_offset, int size);
+static void place_sections(Parser* parser);
+static int find_free_gap(Parser* parser, int size, int alignment);
+static void measure_free_memory(Parser* parser, int* free_bytes, int* largest_gap);
+static void print_memory_map(Parser* parser);
+static void reset_layout(void);
+static void open_data_block(Parser* parser);
+static void record_data(Parser* parser, uint16_t value, int size);
+static void add_label_alias(int label, int block, int offset);
+static void merge_data_blocks(void);
+static void resolve_label_aliases(void);
+static bool superopt_instruction(Parser* parser, Token* token, uint16_t opcode);
+static void scan_instruction(Parser* parser, int instruction, uint16_t opcode, bool after_skip);
+static void add_location_span(Parser* parser, const Expression* expression);
+static void optimize_windows(Parser* parser);
+static bool is_skip(uint16_t opcode);
+static void add_moved_range(int first, int end, const char* option);
+static void add_address_reference(Parser* parser, Token* token, int base, int target);
+static void check_address_references(Parser* parser);
+static bool is_memory_used(int address);
+static void mark_memory(int address, int size);
+static void add_opcode(OpcodeArray* opcode_array, uint16_t opcode, int size, int memory_offset, int source_offset);
+static void add_relocation(Parser* parser, const char* symbol, RelocationKind kind);
+static uint16_t parse_register(Parser* parser, Token* token);
+static uint16_t parse_operand(Parser* parser, Token* token, long max);
+static bool parse_expression(Parser* parser, Token* token, Expression* expression);
+static SymbolKind resolve_symbol(void* context, const char* name, long* value, int* label_weight, long* label_base);
+static void define_constant(Parser* parser, Token* name_token, Token* value_token);
+static Constant* add_constant(Parser* parser, Token* name_token);
+static Constant* find_constant(const char* name, uint32_t hash);
+static void remove_constant(Constant* constant);
+static void clear_constants(void);
 static void parse_label_definition(Parser* parser, Token* token, int memory_offset);
 static int find_label_memory_offset(const char* label);
 static int find_label_index(const char* label);
+static void add_label_slot(int label_index);
+static bool require_target(Parser* parser, Token* token, Target target);
 
 static void expect_token(Parser* parser, const char* expected);
 static bool is_register(const char* value);
-static int is_immediate(const char* value);
+static uint8_t register_number(const char* value);
+static void skip_line(Parser* parser, int offset);
+static int line_end(Parser* parser, int offset);
 static Token* cur_token(Parser* parser);
 static Token* next_token(Parser* parser);
 static bool is_eof_token(Token* token);
 
 static uint16_t handle_ld(Parser* parser);
 static uint16_t handle_ld_v(Parser* parser, Token* token_first_param, Token* token_second_param);
-static uint16_t handle_ld_i(Token* token_first_param, Token* token_second_param);
+static uint16_t handle_ld_i(Parser* parser, Token* token_first_param, Token* token_second_param);
 static uint16_t handle_ld_f(Token* token_first_param, Token* token_second_param);
 static uint16_t handle_ld_b(Token* token_first_param, Token* token_second_param);
 static uint16_t handle_ld_i_addr(Parser* parser, Token* token_first_param, Token* token_second_param);
@@ -66,51 +295,530 @@ static uint16_t handle_ex_instruction(Parser* parser, uint8_t instruction);
 static uint16_t handle_rnd(Parser* parser);
 static uint16_t handle_drw(Parser* parser);
 static uint16_t handle_shl_shr(Parser* parser, const char* type);
-
-void error(Parser* parser, Token* token, const char* fmt, ...) {
+static uint16_t handle_ld_i_long(Parser* parser, Token* token);
+static uint16_t handle_scroll(Parser* parser, Token* token, uint16_t opcode, Target target);
+static uint16_t handle_save_load(Parser* parser, uint8_t instruction);
+static uint16_t handle_plane(Parser* parser);
+static uint16_t handle_fx_instruction(Parser* parser, uint8_t instruction);
+
+static void error(Parser* parser, Token* token, DiagnosticCode code, const char* fmt, ...) {
+    if (parser->muted || parser->silent) {
+        return;
+    }
     parser->hasError = true;
+    if (parser->pass == 2 && token->offset < parser->error_line_end) {
+        return; // Follow-up error of the same broken line
+    }
+    parser->errors++;
+    parser->error_offset = token->offset;
+    parser->error_line_end = line_end(parser, token->offset);
+
+    int line;
+    int column;
+    resolve_location(parser->token_array, token->offset, &line, &column);
+
+    va_list args;
+    va_start(args, fmt);
+    report_va(SEVERITY_ERROR, code, parser->token_array->filename, line, column, fmt, args);
+    va_end(args);
+}
+
+static void warning(Parser* parser, int offset, DiagnosticCode code, const char* fmt, ...) {
+    int line;
+    int column;
+    resolve_location(parser->token_array, offset, &line, &column);
+
     va_list args;
     va_start(args, fmt);
-    printf("Error <%d>: ", token->line);
-    vprintf(fmt, args);
+    report_va(SEVERITY_WARNING, code, parser->token_array->filename, line, column, fmt, args);
     va_end(args);
 }
 
-bool parse(TokenArray* token_array, OpcodeArray* opcode_array) {
+bool parse(TokenArray* token_array, const ParseOptions* options, OpcodeArray* opcode_array) {
+    return parse_program(token_array, options, opcode_array, NULL);
+}
+
+bool parse_relocatable(TokenArray* token_array, const ParseOptions* options, OpcodeArray* opcode_array, RelocationArray* relocation_array) {
+    relocation_array->relocations = malloc(16 * sizeof(Relocation));
+    relocation_array->count = 0;
+    relocation_array->capacity = 16;
+
+    return parse_program(token_array, options, opcode_array, relocation_array);
+}
+
+int target_max_address(Target target) {
+    // XO-CHIP extends the address space to 64 KB, reachable through LD I, LONG
+    return target == TARGET_XOCHIP ? 0xFFFF : 0xFFF;
+}
+
+int get_label_definitions(const LabelDefinition** labels) {
+    *labels = label_definitions;
+    return label_definitions_count;
+}
+
+void get_optimization_stats(OptimizationStats* stats) {
+    *stats = optimization_stats;
+}
+
+void print_optimization_stats(const char* filename, const ParseOptions* options, const OptimizationStats* stats) {
+    if (options->dedup) {
+        printf("%s: merged %d data block(s), %d bytes saved\n", filename, stats->data_blocks_merged, stats->data_bytes_saved);
+    }
+    if (options->superopt_table != NULL) {
+        printf("%s: rewrote %d of %d instruction window(s), %d bytes saved (%d searched)\n", filename, stats->windows_rewritten, stats->windows, stats->window_bytes_saved, stats->windows_searched);
+    }
+}
+
+static bool parse_program(TokenArray* token_array, const ParseOptions* options, OpcodeArray* opcode_array, RelocationArray* relocation_array) {
     Parser parser;
+    parser.token_array = token_array;
     parser.tokens = token_array->tokens;
-    parser.position = 0;
     parser.count = token_array->count;
     parser.hasError = false;
+    parser.relocatable = relocation_array != NULL;
+    parser.relocations = relocation_array;
+    parser.target = options->target;
+    parser.max_address = target_max_address(options->target);
+    parser.has_long_operand = false;
+    parser.opcodes = opcode_array;
+    parser.rept_depth = 0;
+    parser.rept_first_iteration = true;
+    parser.data = false;
+    parser.silent = false;
+    parser.dedup = options->dedup ? DEDUP_SCAN : DEDUP_OFF;
+    parser.superopt = options->superopt_table != NULL ? SUPEROPT_SCAN : SUPEROPT_OFF;
+    parser.superopt_table = options->superopt_table;
+    parser.windows_searched = 0;
+    parser.data_block = -1;
+    parser.errors = 0;
 
     opcode_array->opcodes = malloc(16 * sizeof(Opcode));
     opcode_array->count = 0;
     opcode_array->capacity = 16;
 
-    // Collect label definitions before parsing the program
-    collect_label_definitions(&parser);
+    memory_map_words = (parser.max_address + 1 + 31) / 32;
+    memory_map = malloc(memory_map_words * sizeof(uint32_t));
+    data_blocks_count = 0;
+    data_bytes_count = 0;
+    windows_count = 0;
+    location_spans_count = 0;
+    moved_ranges_count = 0;
+    address_references_count = 0;
+
+    // First pass: walk the whole program to collect label definitions. Instructions are
+    // parsed (not just counted) so that every label gets the offset of the opcode that
+    // actually follows it. Forward references resolve to 0 and diagnostics are muted.
+    // ORG code is reserved in the memory map, sections are then placed into the gaps.
+    // Second pass: emit opcodes with all labels known.
+    // With dedup or the superoptimizer the first pass runs twice, the first run only
+    // collects data blocks and instruction windows.
+    int first_passes = parser.dedup == DEDUP_OFF && parser.superopt == SUPEROPT_OFF ? 1 : 2;
+    for (int run = 1; run <= first_passes + 1; run++) {
+        int pass = run <= first_passes ? 1 : 2;
+        parser.pass = pass;
+        parser.muted = pass == 1;
+        parser.silent = parser.dedup == DEDUP_SCAN || parser.superopt == SUPEROPT_SCAN;
+        parser.data_blocks_seen = 0;
+        parser.instructions_seen = 0;
+        parser.window = parser.superopt == SUPEROPT_SCAN ? -1 : 0;
+        parser.elided_instructions = 0;
+        parser.after_skip = false;
+        parser.first_pending_label = -1;
+        parser.error_offset = -1;
+        parser.error_line_end = -1;
+        if (pass == 1) {
+            reset_layout();
+        }
+        parser.position = 0;
+        parser.section = -1;
+        parser.overlap_reported = false;
+        parser.memory_offset = PROGRAM_START; // Start of the program memory in CHIP-8
+        for (int i = 0; i < sections_count; i++) {
+            sections[i].fill = 0;
+        }
+
+        while (parser.position < parser.count-1 && !error_limit_reached()) { // -1: dont consider EOF token
+            parse_statement(&parser);
+        }
+        enter_section(&parser, -1, parser.memory_offset);
+
+        if (pass == 1) {
+            place_sections(&parser);
+        }
 
-    int memory_offset = 0x200; // Start of the program memory in CHIP-8
+        if (parser.dedup == DEDUP_SCAN) {
+            merge_data_blocks();
+            parser.dedup = DEDUP_APPLY;
+        }
+        else if (parser.dedup == DEDUP_APPLY && pass == 1) {
+            resolve_label_aliases();
+        }
 
-    while (parser.position < parser.count-1) { // -1: dont consider EOF token
-        uint16_t opcode = parse_instruction(&parser, memory_offset);
-        if (opcode != NULL) {
-            add_opcode(opcode_array, opcode, memory_offset);
-            memory_offset += 2; // Increment the memory_offset by 2 since opcodes are 2 bytes long
+        if (parser.superopt == SUPEROPT_SCAN) {
+            optimize_windows(&parser);
+            parser.superopt = SUPEROPT_APPLY;
         }
     }
+    parser.silent = false;
+
+    // Statements skipped at the error limit were never assembled. The limit counts the
+    // errors of all inputs, so it may have been reached before this one started.
+    if (error_limit_reached()) {
+        parser.hasError = true;
+    }
+
+    if (options->print_map && !parser.hasError) {
+        print_memory_map(&parser);
+    }
+
+    if (moved_ranges_count > 0 && !parser.hasError) {
+        check_address_references(&parser);
+    }
+
+    memset(&optimization_stats, 0, sizeof(OptimizationStats));
+    if (parser.dedup != DEDUP_OFF) {
+        for (int i = 0; i < data_blocks_count; i++) {
+            if (data_blocks[i].alias != -1) {
+                optimization_stats.data_blocks_merged++;
+                optimization_stats.data_bytes_saved += data_blocks[i].size;
+            }
+        }
+    }
+    if (parser.superopt != SUPEROPT_OFF) {
+        optimization_stats.windows = windows_count;
+        optimization_stats.windows_searched = parser.windows_searched;
+        for (int i = 0; i < windows_count; i++) {
+            if (windows[i].rewrite_length < windows[i].length) {
+                optimization_stats.windows_rewritten++;
+                optimization_stats.window_bytes_saved += 2 * (windows[i].length - windows[i].rewrite_length);
+            }
+        }
+    }
+    if (!parser.hasError) {
+        print_optimization_stats(token_array->filename, options, &optimization_stats);
+    }
+
+    free(memory_map);
+    memory_map = NULL;
 
     return !parser.hasError;
 }
 
-static uint16_t parse_instruction(Parser* parser, int memory_offset) {
+// Instructions with errors still occupy their slot so both passes agree on the layout.
+// After an error in the second pass the rest of its line is skipped, so a broken line
+// is reported once instead of once per token. First pass errors (labels, REPT, ORG)
+// do not resync, both passes have to see the same statements.
+static void parse_statement(Parser* parser) {
+    Token* token = cur_token(parser);
+    int errors = parser->errors;
+    uint16_t opcode;
+    parser->operand_constant = true;
+    bool emits = parse_instruction(parser, &opcode);
+
+    if (parser->pass == 2 && parser->errors != errors) {
+        skip_line(parser, parser->error_offset);
+    }
+
+    if (emits) {
+        // Section bases are aligned, an odd offset comes from data before the instruction
+        if (parser->pass == 2 && parser->section != -1 && (parser->memory_offset & 1) != 0) {
+            error(parser, token, DIAGNOSTIC_LAYOUT, "instruction at odd address 0x%03X in section '%s'\n", parser->memory_offset, sections[parser->section].name);
+        }
+        if (parser->superopt == SUPEROPT_OFF || !superopt_instruction(parser, token, opcode)) {
+            emit(parser, token, opcode, 2); // opcodes are 2 bytes long
+        }
+
+        if (parser->has_long_operand) {
+            emit(parser, token, parser->long_operand, 2);
+            parser->has_long_operand = false;
+        }
+        if (parser->section != -1) {
+            sections[parser->section].alignment = 2;
+        }
+    }
+}
+
+static bool parse_instruction(Parser* parser, uint16_t* opcode) {
     Token* token = next_token(parser);
-    uint16_t opcode = 0;
+    *opcode = 0;
 
     if (token->value[strlen(token->value) - 1] == ':') {
-        return NULL; // Do not generate an opcode for the label definition
+        // Labels in a REPT body would be defined once per iteration. The first one is
+        // kept so references to it do not report further errors.
+        if (parser->pass == 1 && parser->rept_first_iteration) {
+            parser->muted = false;
+            if (parser->rept_depth > 0) {
+                error(parser, token, DIAGNOSTIC_LAYOUT, "label '%s' inside REPT, use $ for addresses in the body\n", token->value);
+            }
+            parse_label_definition(parser, token, parser->memory_offset);
+            parser->muted = true;
+        }
+        parser->data_block = -1; // A label starts a new data block
+        parser->eliding = false;
+        return false; // Do not generate an opcode for the label definition
+    }
+    else if (strcmp(token->value, "ORG") == 0) {
+        parse_org(parser, token);
+        return false;
+    }
+    else if (strcmp(token->value, "SECTION") == 0) {
+        parse_section(parser, token);
+        return false;
+    }
+    else if (strcmp(token->value, "GLOBAL") == 0) {
+        parse_global(parser);
+        return false;
+    }
+    else if (strcmp(token->value, "DB") == 0) {
+        parse_data(parser, token, 1);
+        return false;
+    }
+    else if (strcmp(token->value, "DW") == 0) {
+        parse_data(parser, token, 2);
+        return false;
+    }
+    else if (strcmp(token->value, "EOF") == 0) {
+        return false;
+    }
+    else if (strcmp(cur_token(parser)->value, "EQU") == 0) {
+        // NAME EQU expression
+        next_token(parser);
+        define_constant(parser, token, next_token(parser));
+        return false;
+    }
+    else if (strcmp(token->value, "DEFINE") == 0) {
+        // DEFINE NAME expression
+        Token* name_token = next_token(parser);
+        define_constant(parser, name_token, next_token(parser));
+        return false;
     }
-    else if (strcmp(token->value, "LD") == 0) {
+    else if (strcmp(token->value, "REPT") == 0) {
+        parse_rept(parser, token);
+        return false;
+    }
+    else if (strcmp(token->value, "ENDR") == 0) {
+        error(parser, token, DIAGNOSTIC_LAYOUT, "ENDR without REPT\n");
+        return false;
+    }
+
+    *opcode = parse_mnemonic(parser, token);
+    return true;
+}
+
+// REPT count [, counter] ... ENDR
+// The body is parsed count times by rewinding to its first token, so unrolled code is
+// generated from the already lexed tokens. The optional counter is a constant holding
+// the current iteration (starting at 0) and is removed again at ENDR.
+static void parse_rept(Parser* parser, Token* token) {
+    int endr = find_endr(parser, token);
+    if (endr == -1) {
+        return;
+    }
+
+    // The count decides the layout, so it has to be known in the first pass already.
+    // Diagnostics are reported there and not repeated in the second pass.
+    bool muted = parser->muted;
+    parser->muted = parser->pass == 2;
+
+    Expression expression;
+    Token* count_token = next_token(parser);
+    bool valid = parse_expression(parser, count_token, &expression);
+    if (valid && (expression.unresolved[0] != '\0' || expression.label_weight != 0 || expression.nonlinear)) {
+        error(parser, count_token, DIAGNOSTIC_LAYOUT, "REPT count must be a constant expression defined before the REPT\n");
+        valid = false;
+    }
+    if (valid && (expression.value < 0 || expression.value > MAX_REPT_COUNT)) {
+        error(parser, count_token, DIAGNOSTIC_OUT_OF_RANGE, "REPT count %ld out of range (0 - %d)\n", expression.value, MAX_REPT_COUNT);
+        valid = false;
+    }
+    if (valid && parser->rept_depth >= MAX_REPT_DEPTH) {
+        error(parser, token, DIAGNOSTIC_LAYOUT, "REPT nested deeper than %d levels\n", MAX_REPT_DEPTH);
+        valid = false;
+    }
+
+    Token* counter_token = NULL;
+    if (valid && strcmp(cur_token(parser)->value, ",") == 0) {
+        next_token(parser);
+        counter_token = next_token(parser);
+        valid = add_constant(parser, counter_token) != NULL;
+    }
+
+    parser->muted = muted;
+
+    if (!valid) {
+        parser->position = endr + 1;
+        return;
+    }
+
+    int body = parser->position;
+    bool first_iteration = parser->rept_first_iteration;
+    parser->rept_depth++;
+
+    for (long iteration = 0; iteration < expression.value; iteration++) {
+        if (counter_token != NULL) {
+            // Looked up again each iteration, constants defined in the body may grow the table
+            Constant* counter = find_constant(counter_token->value, hash_string(counter_token->value));
+            counter->value = iteration;
+            counter->label_weight = 0;
+            counter->label_base = 0;
+            counter->pass = parser->pass;
+            counter->complete = true;
+            counter->address_dependent = false;
+        }
+
+        parser->rept_first_iteration = first_iteration && iteration == 0;
+        parser->position = body;
+        while (parser->position < endr && !error_limit_reached()) {
+            parse_statement(parser);
+        }
+    }
+
+    // The counter is only visible in the body
+    if (counter_token != NULL) {
+        remove_constant(find_constant(counter_token->value, hash_string(counter_token->value)));
+    }
+    parser->rept_first_iteration = first_iteration;
+    parser->rept_depth--;
+    parser->position = endr + 1;
+}
+
+// Returns the token index of the ENDR matching the REPT token
+static int find_endr(Parser* parser, Token* token) {
+    int depth = 0;
+    for (int i = parser->position; i < parser->count - 1; i++) {
+        if (strcmp(parser->tokens[i].value, "REPT") == 0) {
+            depth++;
+        }
+        else if (strcmp(parser->tokens[i].value, "ENDR") == 0) {
+            if (depth == 0) {
+                return i;
+            }
+            depth--;
+        }
+    }
+
+    bool muted = parser->muted;
+    parser->muted = false;
+    error(parser, token, DIAGNOSTIC_LAYOUT, "REPT without ENDR\n");
+    parser->muted = muted;
+    return -1;
+}
+
+// ORG address
+// Following code is assembled at a fixed address. ORG blocks must not overlap.
+static void parse_org(Parser* parser, Token* token) {
+    bool muted = parser->muted;
+    parser->muted = parser->pass == 2;
+
+    Expression expression;
+    Token* address_token = next_token(parser);
+    bool valid = parse_expression(parser, address_token, &expression);
+    if (valid && (expression.unresolved[0] != '\0' || expression.label_weight != 0 || expression.nonlinear)) {
+        error(parser, address_token, DIAGNOSTIC_LAYOUT, "ORG address must be a constant expression defined before the ORG\n");
+        valid = false;
+    }
+    if (valid && (expression.value < PROGRAM_START || expression.value > parser->max_address)) {
+        error(parser, address_token, DIAGNOSTIC_OUT_OF_RANGE, "ORG address 0x%lX outside of the program memory (0x%X - 0x%X)\n", expression.value, PROGRAM_START, parser->max_address);
+        valid = false;
+    }
+    if (valid && parser->relocatable) {
+        error(parser, token, DIAGNOSTIC_NOT_RELOCATABLE, "ORG is not supported in relocatable objects, use SECTION\n");
+        valid = false;
+    }
+
+    parser->muted = muted;
+
+    if (valid) {
+        enter_section(parser, -1, (int)expression.value);
+    }
+}
+
+// SECTION name
+// Following code is appended to the named section, which is placed after the first pass.
+// GLOBAL label [, label]...
+// Exports labels to the other objects of a link, all other labels stay local to the
+// source. The labels may be defined after the GLOBAL, so they are looked up in the
+// second pass.
+static void parse_global(Parser* parser) {
+    for (;;) {
+        Token* name_token = next_token(parser);
+        if (parser->pass == 2) {
+            int label_index = find_label_index(name_token->value);
+            if (label_index == -1) {
+                error(parser, name_token, DIAGNOSTIC_UNDEFINED_SYMBOL, "GLOBAL '%s' is not a label of this source\n", name_token->value);
+            }
+            else {
+                label_definitions[label_index].global = true;
+            }
+        }
+
+        if (strcmp(cur_token(parser)->value, ",") != 0) {
+            break;
+        }
+        next_token(parser);
+    }
+}
+
+static void parse_section(Parser* parser, Token* token) {
+    Token* name_token = next_token(parser);
+    uint32_t hash = hash_string(name_token->value);
+
+    int section = -1;
+    for (int i = 0; i < sections_count; i++) {
+        if (sections[i].hash == hash && strcmp(sections[i].name, name_token->value) == 0) {
+            section = i;
+            break;
+        }
+    }
+
+    if (section == -1) {
+        if (is_eof_token(name_token) || strlen(name_token->value) >= MAX_LABEL_LENGTH) {
+            bool muted = parser->muted;
+            parser->muted = parser->pass == 2;
+            error(parser, token, DIAGNOSTIC_SYNTAX, "SECTION expects a name of at most %d characters\n", MAX_LABEL_LENGTH - 1);
+            parser->muted = muted;
+            return;
+        }
+
+        if (sections_count >= sections_capacity) {
+            sections_capacity = sections_capacity == 0 ? 8 : sections_capacity * 2;
+            sections = realloc(sections, sections_capacity * sizeof(Section));
+        }
+        section = sections_count++;
+        strcpy(sections[section].name, name_token->value);
+        sections[section].hash = hash;
+        sections[section].definition = (int)(token - parser->tokens);
+        sections[section].size = 0;
+        sections[section].fill = 0;
+        sections[section].base = 0;
+        sections[section].alignment = 1;
+    }
+
+    enter_section(parser, section, 0);
+}
+
+// DB byte {, byte}
+// DW word {, word}
+// Words are stored big endian like opcodes. Labels in DW values are relocated.
+static void parse_data(Parser* parser, Token* token, int size) {
+    parser->data = true;
+    for (;;) {
+        Token* value_token = next_token(parser);
+        uint16_t value = parse_operand(parser, value_token, size == 1 ? FIELD_BYTE : FIELD_LONG_ADDRESS);
+        emit(parser, token, value, size);
+
+        if (strcmp(cur_token(parser)->value, ",") != 0) {
+            break;
+        }
+        next_token(parser);
+    }
+    parser->data = false;
+}
+
+static uint16_t parse_mnemonic(Parser* parser, Token* token) {
+    uint16_t opcode = 0;
+
+    if (strcmp(token->value, "LD") == 0) {
         opcode = handle_ld(parser);
     }
     else if (strcmp(token->value, "ADD") == 0) {
@@ -170,272 +878,1179 @@ static uint16_t parse_instruction(Parser* parser, int memory_offset) {
     else if (strcmp(token->value, "DRW") == 0) {
         opcode = handle_drw(parser);
     }
-    else if (strcmp(token->value, "EOF") == 0) {
+    else if (strcmp(token->value, "SCD") == 0) {
+        opcode = handle_scroll(parser, token, 0x00C0, TARGET_SCHIP);
+    }
+    else if (strcmp(token->value, "SCU") == 0) {
+        opcode = handle_scroll(parser, token, 0x00D0, TARGET_XOCHIP);
+    }
+    else if (strcmp(token->value, "SCR") == 0) {
+        opcode = require_target(parser, token, TARGET_SCHIP) ? 0x00FB : 0;
+    }
+    else if (strcmp(token->value, "SCL") == 0) {
+        opcode = require_target(parser, token, TARGET_SCHIP) ? 0x00FC : 0;
+    }
+    else if (strcmp(token->value, "EXIT") == 0) {
+        opcode = require_target(parser, token, TARGET_SCHIP) ? 0x00FD : 0;
+    }
+    else if (strcmp(token->value, "LOW") == 0) {
+        opcode = require_target(parser, token, TARGET_SCHIP) ? 0x00FE : 0;
+    }
+    else if (strcmp(token->value, "HIGH") == 0) {
+        opcode = require_target(parser, token, TARGET_SCHIP) ? 0x00FF : 0;
+    }
+    else if (strcmp(token->value, "SAVE") == 0) {
+        opcode = handle_save_load(parser, 0x2);
+        opcode = require_target(parser, token, TARGET_XOCHIP) ? opcode : 0;
+    }
+    else if (strcmp(token->value, "LOAD") == 0) {
+        opcode = handle_save_load(parser, 0x3);
+        opcode = require_target(parser, token, TARGET_XOCHIP) ? opcode : 0;
+    }
+    else if (strcmp(token->value, "PLANE") == 0) {
+        opcode = handle_plane(parser);
+        opcode = require_target(parser, token, TARGET_XOCHIP) ? opcode : 0;
+    }
+    else if (strcmp(token->value, "AUDIO") == 0) {
+        opcode = require_target(parser, token, TARGET_XOCHIP) ? 0xF002 : 0;
+    }
+    else if (strcmp(token->value, "PITCH") == 0) {
+        opcode = handle_fx_instruction(parser, 0x3A);
+        opcode = require_target(parser, token, TARGET_XOCHIP) ? opcode : 0;
+    }
+    else {
+        error(parser, token, DIAGNOSTIC_UNKNOWN_INSTRUCTION, "unknown instruction: '%s'\n", token->value);
+        return 0;
+    }
+
+    return opcode;
+}
+
+static void parse_label_definition(Parser* parser, Token* token, int memory_offset) {
+    size_t len = strlen(token->value);
+
+    if (len > MAX_LABEL_LENGTH) {
+        error(parser, token, DIAGNOSTIC_SYNTAX, "label '%s' exceeds the maximum length of %d characters\n", token->value, MAX_LABEL_LENGTH - 1);
+        return;
+    }
+
+    char name[MAX_LABEL_LENGTH];
+    memcpy(name, token->value, len - 1);
+    name[len - 1] = '\0'; // drop the colon
+
+    if (find_label_index(name) != -1) {
+        error(parser, token, DIAGNOSTIC_DUPLICATE_SYMBOL, "label '%s' already defined\n", token->value);
+        return; // Label has already been defined, skip it
+    }
+
+    if (memory_offset > parser->max_address) {
+        error(parser, token, DIAGNOSTIC_SYNTAX, "memory offset (0x%X) for label '%s' exceeds the address space of the target (0x%X)\n", memory_offset, token->value, parser->max_address);
+        return;
+    }
+
+    if (label_definitions_count >= label_definitions_capacity) {
+        label_definitions_capacity = label_definitions_capacity == 0 ? 64 : label_definitions_capacity * 2;
+        label_definitions = realloc(label_definitions, label_definitions_capacity * sizeof(LabelDefinition));
+    }
+
+    LabelDefinition* label = &label_definitions[label_definitions_count];
+    strcpy(label->name, name);
+    label->hash = hash_string(name);
+    label->memory_offset = memory_offset;
+    label->section = parser->section;
+    label->global = false;
+    add_label_slot(label_definitions_count);
+
+    if (parser->first_pending_label == -1) {
+        parser->first_pending_label = label_definitions_count;
+    }
+
+    label_definitions_count++;
+}
+
+static void add_label_slot(int label_index) {
+    // Keep the load factor at or below 1/2, rebuilding the index when growing
+    if ((uint32_t)(label_definitions_count + 1) * 2 > label_slots_capacity) {
+        label_slots_capacity = label_slots_capacity == 0 ? 128 : label_slots_capacity * 2;
+        free(label_slots);
+        label_slots = calloc(label_slots_capacity, sizeof(int));
+        for (int i = 0; i < label_index; i++) {
+            add_label_slot(i);
+        }
+    }
+
+    uint32_t index = label_definitions[label_index].hash & (label_slots_capacity - 1);
+    while (label_slots[index] != 0) {
+        index = (index + 1) & (label_slots_capacity - 1);
+    }
+    label_slots[index] = label_index + 1;
+}
+
+static uint16_t parse_register(Parser* parser, Token* token) {
+    if (!is_register(token->value)) {
+        error(parser, token, DIAGNOSTIC_INVALID_REGISTER, "invalid register '%s'\n", token->value);
+        return 0;
+    }
+    return register_number(token->value);
+}
+
+// Evaluates the operand expression starting at token and checks that it fits into
+// a field with the given maximum value. Tokens belonging to the expression are consumed.
+static uint16_t parse_operand(Parser* parser, Token* token, long max) {
+    Expression expression;
+    parser->operand_constant = false;
+    if (!parse_expression(parser, token, &expression)) {
+        return 0;
+    }
+    parser->operand_constant = !expression.address_dependent;
+
+    bool is_address = max == FIELD_ADDRESS || max == FIELD_LONG_ADDRESS;
+    RelocationKind relocation_kind = max == FIELD_LONG_ADDRESS ? RELOCATION_ADDRESS16 : RELOCATION_ADDRESS12;
+
+    if (expression.unresolved[0] != '\0') {
+        // Imported labels are only allowed as "label + constant" in address fields
+        if (!parser->relocatable || !is_address || expression.label_weight != 1 || expression.nonlinear) {
+            error(parser, token, DIAGNOSTIC_UNDEFINED_SYMBOL, "symbol '%s' not found\n", expression.unresolved);
+            return 0;
+        }
+        add_relocation(parser, expression.unresolved, relocation_kind);
+        if (expression.value < 0 || expression.value > max) {
+            error(parser, token, DIAGNOSTIC_OUT_OF_RANGE, "offset %ld from imported symbol '%s' exceeds the field range\n", expression.value, expression.unresolved);
+            return 0;
+        }
+        return (uint16_t)expression.value;
+    }
+
+    if (parser->relocatable && (expression.nonlinear || (expression.label_weight != 0 && (expression.label_weight != 1 || !is_address)))) {
+        error(parser, token, DIAGNOSTIC_NOT_RELOCATABLE, "expression is not relocatable, labels can only be used as 'label + constant' in address fields\n");
+        return 0;
+    }
+
+    // Byte fields accept negative values down to -128 (two's complement)
+    long min = max == FIELD_BYTE ? -128 : 0;
+    if (expression.value < min || expression.value > max) {
+        error(parser, token, DIAGNOSTIC_OUT_OF_RANGE, "value %ld (0x%lX) exceeds the field range (0x%lX)\n", expression.value, expression.value, max);
+        return 0;
+    }
+
+    if (parser->relocatable && expression.label_weight == 1) {
+        add_relocation(parser, NULL, relocation_kind);
+    }
+
+    // Anything but a plain label may point into or across code the optimizations moved
+    if (!expression.nonlinear && expression.label_weight == 1 && expression.value != expression.label_base) {
+        add_address_reference(parser, token, (int)expression.label_base, (int)expression.value);
+    }
+    else if (is_address && !expression.address_dependent) {
+        add_address_reference(parser, token, -1, (int)expression.value);
+    }
+
+    return (uint16_t)(expression.value & max);
+}
+
+static bool parse_expression(Parser* parser, Token* token, Expression* expression) {
+    const char* source = parser->token_array->source;
+    bool success = evaluate_expression(source, token->offset, parser->memory_offset, resolve_symbol, parser, expression);
+    if (success && expression->uses_location && parser->superopt == SUPEROPT_SCAN) {
+        add_location_span(parser, expression);
+    }
+
+    // Skip the tokens covered by the expression
+    parser->position = (int)(token - parser->tokens) + 1;
+    while (parser->position < parser->count - 1 && parser->tokens[parser->position].offset < expression->end) {
+        parser->position++;
+    }
+
+    if (!success) {
+        Token location = *token;
+        location.offset = expression->error_offset;
+        DiagnosticCode code = expression->out_of_range ? DIAGNOSTIC_OUT_OF_RANGE : DIAGNOSTIC_SYNTAX;
+        error(parser, &location, code, "%s in '%.*s'\n", expression->error, expression->end - token->offset, source + token->offset);
+        return false;
+    }
+    return true;
+}
+
+static SymbolKind resolve_symbol(void* context, const char* name, long* value, int* label_weight, long* label_base) {
+    Parser* parser = context;
+
+    Constant* constant = find_constant(name, hash_string(name));
+    if (constant != NULL) {
+        if (parser->pass == 2 && constant->pass == 1 && !constant->complete) {
+            return SYMBOL_UNDEFINED; // Used before its definition, which depends on a forward label
+        }
+        *value = constant->value;
+        *label_weight = constant->label_weight;
+        *label_base = constant->label_base;
+        return constant->address_dependent || !constant->complete ? SYMBOL_ADDRESS_CONSTANT : SYMBOL_CONSTANT;
+    }
+
+    int label_index = find_label_index(name);
+    if (label_index != -1) {
+        *value = label_definitions[label_index].memory_offset;
+        *label_weight = 1;
+        *label_base = *value;
+        return SYMBOL_LABEL;
+    }
+
+    return SYMBOL_UNDEFINED;
+}
+
+// Constants are evaluated in both passes: values depending on forward labels are
+// only known in the second pass.
+static void define_constant(Parser* parser, Token* name_token, Token* value_token) {
+    const char* name = name_token->value;
+
+    Expression expression;
+    if (!parse_expression(parser, value_token, &expression)) {
+        return;
+    }
+
+    bool complete = expression.unresolved[0] == '\0';
+    if (!complete && parser->pass == 2) {
+        error(parser, value_token, DIAGNOSTIC_UNDEFINED_SYMBOL, "symbol '%s' not found\n", expression.unresolved);
+        return;
+    }
+    if (parser->relocatable && (expression.nonlinear || expression.label_weight < 0 || expression.label_weight > 1)) {
+        error(parser, value_token, DIAGNOSTIC_NOT_RELOCATABLE, "constant '%s' is not relocatable, labels can only be used as 'label + constant'\n", name);
+        return;
+    }
+
+    Constant* constant = add_constant(parser, name_token);
+    if (constant == NULL) {
+        return;
+    }
+
+    constant->value = expression.value;
+    constant->label_weight = expression.label_weight;
+    constant->label_base = expression.label_base;
+    constant->pass = parser->pass;
+    constant->complete = complete;
+    constant->address_dependent = expression.address_dependent;
+}
+
+// Returns the constant defined by name_token, creating it on its first definition
+static Constant* add_constant(Parser* parser, Token* name_token) {
+    const char* name = name_token->value;
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_' && name[0] != '.') {
+        error(parser, name_token, DIAGNOSTIC_SYNTAX, "invalid constant name '%s'\n", name);
+        return NULL;
+    }
+    if (strlen(name) >= MAX_LABEL_LENGTH) {
+        error(parser, name_token, DIAGNOSTIC_SYNTAX, "constant '%s' exceeds the maximum length of %d characters\n", name, MAX_LABEL_LENGTH - 1);
+        return NULL;
+    }
+    if (is_register(name) || find_label_index(name) != -1) {
+        error(parser, name_token, DIAGNOSTIC_DUPLICATE_SYMBOL, "'%s' is already defined\n", name);
         return NULL;
     }
+
+    int definition = (int)(name_token - parser->tokens);
+    uint32_t hash = hash_string(name);
+    Constant* constant = find_constant(name, hash);
+
+    if (constant != NULL && constant->definition != definition) {
+        error(parser, name_token, DIAGNOSTIC_DUPLICATE_SYMBOL, "constant '%s' already defined\n", name);
+        return NULL;
+    }
+
+    if (constant == NULL) {
+        // Keep the load factor below 3/4
+        if ((constants_count + 1) * 4 > constants_capacity * 3) {
+            Constant* old_constants = constants;
+            uint32_t old_capacity = constants_capacity;
+            constants_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+            constants = calloc(constants_capacity, sizeof(Constant));
+            for (uint32_t i = 0; i < old_capacity; i++) {
+                if (old_constants[i].name[0] != '\0') {
+                    uint32_t index = old_constants[i].hash & (constants_capacity - 1);
+                    while (constants[index].name[0] != '\0') {
+                        index = (index + 1) & (constants_capacity - 1);
+                    }
+                    constants[index] = old_constants[i];
+                }
+            }
+            free(old_constants);
+        }
+
+        uint32_t index = hash & (constants_capacity - 1);
+        while (constants[index].name[0] != '\0') {
+            index = (index + 1) & (constants_capacity - 1);
+        }
+        constant = &constants[index];
+        strcpy(constant->name, name);
+        constant->hash = hash;
+        constant->definition = definition;
+        constants_count++;
+    }
+
+    return constant;
+}
+
+static Constant* find_constant(const char* name, uint32_t hash) {
+    if (constants_count == 0) {
+        return NULL;
+    }
+    uint32_t index = hash & (constants_capacity - 1);
+    while (constants[index].name[0] != '\0') {
+        if (constants[index].hash == hash && strcmp(constants[index].name, name) == 0) {
+            return &constants[index];
+        }
+        index = (index + 1) & (constants_capacity - 1);
+    }
+    return NULL;
+}
+
+// Backward shift deletion, keeps the probe sequences of the remaining constants intact
+static void remove_constant(Constant* constant) {
+    uint32_t mask = constants_capacity - 1;
+    uint32_t hole = (uint32_t)(constant - constants);
+    uint32_t index = (hole + 1) & mask;
+    while (constants[index].name[0] != '\0') {
+        uint32_t home = constants[index].hash & mask;
+        // Move the entry into the hole unless its home slot lies between the two
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            constants[hole] = constants[index];
+            hole = index;
+        }
+        index = (index + 1) & mask;
+    }
+    memset(&constants[hole], 0, sizeof(Constant));
+    constants_count--;
+}
+
+static void clear_constants(void) {
+    if (constants != NULL) {
+        memset(constants, 0, constants_capacity * sizeof(Constant));
+    }
+    constants_count = 0;
+}
+
+static void add_opcode(OpcodeArray* opcode_array, uint16_t opcode, int size, int memory_offset, int source_offset) {
+    if (opcode_array->count >= opcode_array->capacity) {
+        opcode_array->capacity *= 2;
+        opcode_array->opcodes = realloc(opcode_array->opcodes, opcode_array->capacity * sizeof(Opcode));
+    }
+    opcode_array->opcodes[opcode_array->count].value = opcode;
+    opcode_array->opcodes[opcode_array->count].memory_offset = memory_offset;
+    opcode_array->opcodes[opcode_array->count].size = size;
+    opcode_array->opcodes[opcode_array->count].source_offset = source_offset;
+    opcode_array->count++;
+}
+
+static void add_relocation(Parser* parser, const char* symbol, RelocationKind kind) {
+    if (parser->pass != 2) {
+        return;
+    }
+
+    RelocationArray* relocation_array = parser->relocations;
+    if (relocation_array->count >= relocation_array->capacity) {
+        relocation_array->capacity *= 2;
+        relocation_array->relocations = realloc(relocation_array->relocations, relocation_array->capacity * sizeof(Relocation));
+    }
+
+    Relocation* relocation = &relocation_array->relocations[relocation_array->count++];
+    // 16-bit addresses live in the word following the opcode, except for DW words
+    relocation->memory_offset = kind == RELOCATION_ADDRESS16 && !parser->data ? parser->memory_offset + 2 : parser->memory_offset;
+    relocation->kind = kind;
+    if (symbol != NULL) {
+        strncpy(relocation->symbol, symbol, MAX_LABEL_LENGTH - 1);
+        relocation->symbol[MAX_LABEL_LENGTH - 1] = '\0';
+    }
     else {
-        error(parser, token, "unknown instruction: '%s'\n", token->value);
+        relocation->symbol[0] = '\0';
+    }
+}
+
+static void expect_token(Parser* parser, const char* expected) {
+    Token* token = cur_token(parser);
+    if (strlen(token->value) != strlen(expected) || strcmp(token->value, expected) != 0) {
+        error(parser, token, DIAGNOSTIC_SYNTAX, "expected '%s', but got '%s'\n", expected, token->value);
+    }
+    next_token(parser);
+}
+
+// Moves past the tokens on the line containing the source offset
+static void skip_line(Parser* parser, int offset) {
+    int end = line_end(parser, offset);
+    while (parser->position < parser->count - 1 && parser->tokens[parser->position].offset < end) {
+        parser->position++;
+    }
+}
+
+// Source offset of the newline ending the line that contains offset
+static int line_end(Parser* parser, int offset) {
+    const char* source = parser->token_array->source;
+    const char* newline = strchr(source + offset, '\n');
+    return newline != NULL ? (int)(newline - source) : INT_MAX;
+}
+
+static Token* cur_token(Parser* parser) {
+    return &parser->tokens[parser->position];
+}
+
+static Token* next_token(Parser* parser) {
+    Token* token = cur_token(parser);
+    
+    if (parser->position >= parser->count) {
         return NULL;
     }
 
-    return opcode;
+    if (is_eof_token(token)) {
+        return token;
+    }
+
+    parser->position++;
+    return token;
+}
+
+static bool is_eof_token(Token* token) {
+    return strcmp(token->value, "EOF") == 0;
+}
+
+static bool require_target(Parser* parser, Token* token, Target target) {
+    if (parser->target >= target) {
+        return true;
+    }
+    error(parser, token, DIAGNOSTIC_TARGET, "'%s' requires the %s target\n", token->value, target == TARGET_SCHIP ? "SUPER-CHIP" : "XO-CHIP");
+    return false;
+}
+
+static bool is_register(const char* value) {
+    if (strlen(value) != 2) {
+        return false;
+    }
+    return value[0] == 'V' && ((value[1] >= '0' && value[1] <= '9') || (value[1] >= 'A' && value[1] <= 'F'));
+}
+
+static uint8_t register_number(const char* value) {
+    char c = value[1];
+    return (uint8_t)(c <= '9' ? c - '0' : c - 'A' + 10);
+}
+
+static int find_label_memory_offset(const char* label) {
+    int label_index = find_label_index(label);
+    return label_index == -1 ? -1 : label_definitions[label_index].memory_offset;
+}
+
+static int find_label_index(const char* label) {
+    if (label_definitions_count == 0) {
+        return -1;
+    }
+
+    uint32_t hash = hash_string(label);
+    uint32_t index = hash & (label_slots_capacity - 1);
+    while (label_slots[index] != 0) {
+        LabelDefinition* definition = &label_definitions[label_slots[index] - 1];
+        if (definition->hash == hash && strcmp(label, definition->name) == 0) {
+            return label_slots[index] - 1;
+        }
+        index = (index + 1) & (label_slots_capacity - 1);
+    }
+    return -1;
+}
+
+static uint16_t handle_ld_v(Parser* parser, Token* token_first_param, Token* token_second_param) {
+    uint8_t register_x = parse_register(parser, token_first_param);
+    uint16_t opcode;
+
+    if (is_register(token_second_param->value)) {
+        // 8xy0 - LD Vx, Vy
+        uint8_t register_y = parse_register(parser, token_second_param);
+        opcode = 0x8000 | (register_x << 8) | (register_y << 4);
+    }
+    else if (strcmp(token_second_param->value, "DT") == 0) {
+        // Fx07 - LD Vx, DT
+        opcode = 0xF000 | (register_x << 8) | 0x07;
+    }
+    else if (strcmp(token_second_param->value, "K") == 0) {
+        // Fx0A - LD Vx, K
+        opcode = 0xF000 | (register_x << 8) | 0x0A;
+    }
+    else if (strcmp(token_second_param->value, "[I]") == 0) {
+        // Fx65 - LD Vx, [I]
+        opcode = 0xF000 | (register_x << 8) | 0x65;
+    }
+    else if (strcmp(token_second_param->value, "R") == 0) {
+        // Fx85 - LD Vx, R
+        opcode = require_target(parser, token_second_param, TARGET_SCHIP) ? 0xF000 | (register_x << 8) | 0x85 : 0;
+    }
+    else {
+        // 6xkk - LD Vx, byte
+        uint8_t byte = parse_operand(parser, token_second_param, FIELD_BYTE);
+        opcode = 0x6000 | (register_x << 8) | byte;
+    }
+
+    return opcode;
+}
+
+static uint16_t handle_ld_i(Parser* parser, Token* token_first_param, Token* token_second_param) {
+    if (strcmp(token_second_param->value, "LONG") == 0) {
+        return handle_ld_i_long(parser, token_second_param);
+    }
+
+    uint16_t address = parse_operand(parser, token_second_param, FIELD_ADDRESS);
+    uint16_t opcode = 0xA000 | address;
+    return opcode;
+}
+
+static uint16_t handle_ld_f(Token* token_first_param, Token* token_second_param) {
+    uint8_t register_x = register_number(token_second_param->value);
+    uint16_t opcode = 0xF000 | (register_x << 8) | 0x29;
+    return opcode;
+}
+
+static uint16_t handle_ld_b(Token* token_first_param, Token* token_second_param) {
+    uint8_t register_x = register_number(token_second_param->value);
+    uint16_t opcode = 0xF000 | (register_x << 8) | 0x33;
+    return opcode;
+}
+
+static uint16_t handle_ld_dt(Token* token_first_param, Token* token_second_param) {
+    uint8_t register_x = register_number(token_second_param->value);
+    uint16_t opcode = 0xF000 | (register_x << 8) | 0x15;
+    return opcode;
+}
+
+static uint16_t handle_ld_st(Token* token_first_param, Token* token_second_param) {
+    uint8_t register_x = register_number(token_second_param->value);
+    uint16_t opcode = 0xF000 | (register_x << 8) | 0x18;
+    return opcode;
+}
+
+static uint16_t handle_ld_i_addr(Parser* parser, Token* token_first_param, Token* token_second_param) {
+    uint8_t register_x = register_number(token_second_param->value);
+    uint16_t opcode;
+
+    if (strcmp(token_first_param->value, "[I]") == 0 && token_second_param->value[0] == 'V') {
+        opcode = 0xF000 | (register_x << 8) | 0x55;
+    }
+    else if (token_second_param->value[0] == 'V' && strcmp(token_first_param->value, "V") == 0) {
+        opcode = 0xF000 | (register_x << 8) | 0x65;
+    }
+    else {
+        error(parser, token_second_param, DIAGNOSTIC_SYNTAX, "invalid second LD parameter '%s'\n", token_second_param->value);
+        return 0;
+    }
+
+    return opcode;
+}
+
+void free_opcode_array(OpcodeArray* opcode_array) {
+    free(opcode_array->opcodes);
+}
+
+void free_relocation_array(RelocationArray* relocation_array) {
+    free(relocation_array->relocations);
+}
+
+/*********************************************************************************
+* Memory layout
+*********************************************************************************/
+
+// Writes a value at the current memory offset. In the first pass ORG code is reserved
+// in the memory map, section contents are only counted.
+static void emit(Parser* parser, Token* token, uint16_t value, int size) {
+    if (parser->dedup != DEDUP_OFF) {
+        if (!parser->data) {
+            parser->data_block = -1;
+            parser->eliding = false;
+        }
+        else if (parser->data_block == -1) {
+            open_data_block(parser);
+        }
+
+        if (parser->eliding) {
+            // The labels in front of the block move to the surviving copy
+            for (int i = parser->first_pending_label; i != -1 && i < label_definitions_count; i++) {
+                add_label_alias(i, parser->data_block, parser->elided_size);
+            }
+            parser->first_pending_label = -1;
+            parser->elided_size += size;
+            return;
+        }
+        if (parser->dedup == DEDUP_SCAN && parser->data) {
+            record_data(parser, value, size);
+        }
+    }
+    parser->first_pending_label = -1;
+
+    if (parser->pass == 1 && parser->section == -1) {
+        reserve_memory(parser, token, parser->memory_offset, size);
+    }
+    else if (parser->pass == 2) {
+        add_opcode(parser->opcodes, value, size, parser->memory_offset, token->offset);
+    }
+    parser->memory_offset += size;
+}
+
+// Continues assembling in a section (at its current fill) or, for -1, at memory_offset
+static void enter_section(Parser* parser, int section, int memory_offset) {
+    if (parser->section != -1) {
+        sections[parser->section].fill = parser->memory_offset - sections[parser->section].base;
+    }
+
+    parser->section = section;
+    parser->memory_offset = section == -1 ? memory_offset : sections[section].base + sections[section].fill;
+    parser->overlap_reported = false;
+    parser->data_block = -1;
+    parser->eliding = false;
+    parser->first_pending_label = -1;
+}
+
+static void reserve_memory(Parser* parser, Token* token, int memory_offset, int size) {
+    if (parser->overlap_reported) {
+        return;
+    }
+
+    bool muted = parser->muted;
+    parser->muted = false;
+
+    if (memory_offset + size > parser->max_address + 1) {
+        error(parser, token, DIAGNOSTIC_OUT_OF_RANGE, "code at 0x%X exceeds the address space of the target (0x%X)\n", memory_offset, parser->max_address + 1);
+        parser->overlap_reported = true;
+    }
+    else {
+        for (int address = memory_offset; address < memory_offset + size; address++) {
+            if (is_memory_used(address)) {
+                error(parser, token, DIAGNOSTIC_LAYOUT, "code at 0x%X overlaps code assembled before\n", address);
+                parser->overlap_reported = true;
+                break;
+            }
+        }
+        mark_memory(memory_offset, size);
+    }
+
+    parser->muted = muted;
+}
+
+static int compare_section_size(const void* a, const void* b) {
+    const Section* left = &sections[*(const int*)a];
+    const Section* right = &sections[*(const int*)b];
+    if (left->size != right->size) {
+        return right->size - left->size;
+    }
+    return *(const int*)a - *(const int*)b;
+}
+
+// Best fit decreasing: the largest sections are placed first, each into the smallest
+// gap that holds it. Labels defined in sections are rebased to their final address.
+static void place_sections(Parser* parser) {
+    if (sections_count == 0) {
+        return;
+    }
+
+    int* order = malloc(sections_count * sizeof(int));
+    for (int i = 0; i < sections_count; i++) {
+        sections[i].size = sections[i].fill;
+        order[i] = i;
+    }
+    qsort(order, sections_count, sizeof(int), compare_section_size);
+
+    bool muted = parser->muted;
+    parser->muted = false;
+
+    for (int i = 0; i < sections_count; i++) {
+        Section* section = &sections[order[i]];
+        int base = find_free_gap(parser, section->size, section->alignment);
+        if (base == -1) {
+            int free_bytes;
+            int largest_gap;
+            measure_free_memory(parser, &free_bytes, &largest_gap);
+            error(parser, &parser->tokens[section->definition], DIAGNOSTIC_LAYOUT, "section '%s' (%d bytes) does not fit, %d bytes free, largest gap %d bytes\n", section->name, section->size, free_bytes, largest_gap);
+            base = PROGRAM_START;
+        }
+        else {
+            mark_memory(base, section->size);
+        }
+        section->base = base;
+    }
+
+    parser->muted = muted;
+    free(order);
+
+    for (int i = 0; i < label_definitions_count; i++) {
+        if (label_definitions[i].section != -1) {
+            label_definitions[i].memory_offset += sections[label_definitions[i].section].base;
+        }
+    }
+}
+
+// Returns the aligned start of the smallest free gap of at least size bytes, or -1
+static int find_free_gap(Parser* parser, int size, int alignment) {
+    int end = parser->max_address + 1;
+    int best = -1;
+    int best_length = 0;
+
+    int address = PROGRAM_START;
+    while (address < end) {
+        // Skip taken memory a word of the bitmap at a time
+        if ((address & 31) == 0 && memory_map[address >> 5] == 0xFFFFFFFF) {
+            address += 32;
+            continue;
+        }
+        if (is_memory_used(address)) {
+            address++;
+            continue;
+        }
+
+        int start = address;
+        while (address < end && !is_memory_used(address)) {
+            address += (address & 31) == 0 && memory_map[address >> 5] == 0 && address + 32 <= end ? 32 : 1;
+        }
+
+        int aligned = (start + alignment - 1) & ~(alignment - 1);
+        int length = address - start;
+        if (address - aligned >= size && (best == -1 || length < best_length)) {
+            best = aligned;
+            best_length = length;
+        }
+    }
+
+    return best;
+}
+
+static void measure_free_memory(Parser* parser, int* free_bytes, int* largest_gap) {
+    *free_bytes = 0;
+    *largest_gap = 0;
+
+    int gap = 0;
+    for (int address = PROGRAM_START; address <= parser->max_address; address++) {
+        if (is_memory_used(address)) {
+            gap = 0;
+            continue;
+        }
+        (*free_bytes)++;
+        gap++;
+        if (gap > *largest_gap) {
+            *largest_gap = gap;
+        }
+    }
 }
 
-void collect_label_definitions(Parser* parser) {
-    int memory_offset = 0x200; // Start of the program memory in CHIP-8
-    int position = 0;
+static void print_memory_map(Parser* parser) {
+    printf("%s: memory map\n", parser->token_array->filename);
 
-    // -1: dont consider EOF token
-    while (position < parser->count-1) {
-        Token* token = next_token(parser);
+    int address = PROGRAM_START;
+    while (address <= parser->max_address) {
+        int section = -1;
+        for (int i = 0; i < sections_count; i++) {
+            if (sections[i].size > 0 && address >= sections[i].base && address < sections[i].base + sections[i].size) {
+                section = i;
+                break;
+            }
+        }
 
-        if (token->value[strlen(token->value) - 1] == ':') {
-            parse_label_definition(parser, token, memory_offset);
-            // Increment the memory_offset by 2 since opcodes are 2 bytes long
-            // Do not increment if the label is the last token in the token array
-            if (position < parser->count - 2) { // -2: dont consider EOF token
-                memory_offset += 2;
+        if (section != -1) {
+            printf("  0x%04X - 0x%04X  %5d bytes  section %s\n", address, sections[section].base + sections[section].size - 1, sections[section].size, sections[section].name);
+            address = sections[section].base + sections[section].size;
+        }
+        else if (is_memory_used(address)) {
+            int start = address;
+            bool in_section = false;
+            while (address <= parser->max_address && is_memory_used(address) && !in_section) {
+                address++;
+                for (int i = 0; i < sections_count; i++) {
+                    in_section = in_section || (sections[i].size > 0 && address == sections[i].base);
+                }
             }
+            printf("  0x%04X - 0x%04X  %5d bytes  ORG\n", start, address - 1, address - start);
         }
         else {
-            memory_offset += 2;
+            address++;
         }
-
-        position++;
     }
-    parser->position = 0;
+
+    int free_bytes;
+    int largest_gap;
+    measure_free_memory(parser, &free_bytes, &largest_gap);
+    printf("  %d bytes free, largest gap %d bytes\n", free_bytes, largest_gap);
 }
 
-static void parse_label_definition(Parser* parser, Token* token, int memory_offset) {
-    for (int i = 0; i < label_definitions_count; i++) {
-        if (strcmp(token->value, label_definitions[i].name) == 0) {
-            error(parser, token, "label '%s' already defined\n", token->value);
-            return; // Label has already been defined, skip it
-        }
-    }
+static bool is_memory_used(int address) {
+    return (memory_map[address >> 5] >> (address & 31)) & 1;
+}
 
-    if (label_definitions_count >= MAX_LABELS) {
-        error(parser, token, "maximum number of labels reached: max %d\n", token->value, MAX_LABELS);
-        return;
+static void mark_memory(int address, int size) {
+    for (int i = address; i < address + size; i++) {
+        memory_map[i >> 5] |= 1u << (i & 31);
     }
+}
 
-    if (memory_offset > 0xFFF) {
-        error(parser, token, "memory offset (0x%X) for label '%s' exceeds the 12-bit address space\n", memory_offset, token->value);
-        return;
+// Clears labels, constants, sections and the memory map for a first pass
+static void reset_layout(void) {
+    label_definitions_count = 0;
+    if (label_slots != NULL) {
+        memset(label_slots, 0, label_slots_capacity * sizeof(int));
     }
+    clear_constants();
+    sections_count = 0;
+    label_aliases_count = 0;
 
-    size_t len = strlen(token->value);
-    strncpy(label_definitions[label_definitions_count].name, token->value, len);
-    label_definitions[label_definitions_count].name[len - 1] = '\0'; // replace the colon with a null terminator
-    label_definitions[label_definitions_count].memory_offset = memory_offset;
-    label_definitions_count++;
+    // The interpreter area below the program start is never free
+    memset(memory_map, 0, memory_map_words * sizeof(uint32_t));
+    mark_memory(0, PROGRAM_START);
 }
 
-static uint16_t parse_register(Parser* parser, Token* token) {
-    if (strlen(token->value) != 2 || token->value[0] != 'V') {
-        error(parser, token, "invalid register '%s'\n", token->value);
-        return NULL;
+/*********************************************************************************
+* Data block deduplication
+*********************************************************************************/
+
+// Blocks are numbered in the order they are opened, which is the same in every pass
+static void open_data_block(Parser* parser) {
+    int block = parser->data_blocks_seen++;
+    parser->data_block = block;
+    parser->eliding = false;
+    parser->elided_size = 0;
+
+    if (parser->dedup == DEDUP_SCAN) {
+        if (data_blocks_count >= data_blocks_capacity) {
+            data_blocks_capacity = data_blocks_capacity == 0 ? 64 : data_blocks_capacity * 2;
+            data_blocks = realloc(data_blocks, data_blocks_capacity * sizeof(DataBlock));
+        }
+        DataBlock* scanned = &data_blocks[data_blocks_count++];
+        scanned->start = data_bytes_count;
+        scanned->size = 0;
+        scanned->eligible = parser->first_pending_label != -1; // Only reachable through its labels
+        scanned->alias = -1;
+        scanned->alias_offset = 0;
     }
-    uint16_t reg = token->value[1] - '0';
-    if (reg > 15 || reg < 0) {
-        error(parser, token, "invalid register number '%s'\n", token->value);
-        return NULL;
+    else if (block >= data_blocks_count) {
+        return; // The program took a different path than in the scan, keep the block
     }
-    return reg;
-}
 
-static uint16_t parse_immediate(Parser* parser, Token* token) {
-    char* end;
-    int base = is_immediate(token->value);
-    if (!base) {
-        error(parser, token, "invalid immediate value: '%s'\n", token->value);
-        return NULL;
+    DataBlock* data_block = &data_blocks[block];
+    data_block->memory_offset = parser->memory_offset;
+    data_block->section = parser->section;
+
+    parser->eliding = data_block->alias != -1;
+    if (parser->eliding && parser->pass == 2) {
+        add_moved_range(parser->memory_offset, parser->memory_offset, "--dedup");
     }
-    long imm = strtol(token->value, &end, base);
-    if (*end != '\0' || imm < 0) {
-        error(parser, token, "invalid immediate value: '%s'\n", token->value);
-        return NULL;
+}
+
+static void record_data(Parser* parser, uint16_t value, int size) {
+    DataBlock* data_block = &data_blocks[parser->data_block];
+    data_block->eligible = data_block->eligible && parser->operand_constant;
+
+    if (data_bytes_count + size > data_bytes_capacity) {
+        data_bytes_capacity = data_bytes_capacity == 0 ? 1024 : data_bytes_capacity * 2;
+        data_bytes = realloc(data_bytes, data_bytes_capacity);
     }
-    if (*end != '\0' || imm < 0 || imm > 0xFFF) {
-        error(parser, token, "immediate value '%s' exceeds MAX (0xFFF)\n", token->value);
-        return NULL;
+    if (size == 2) {
+        data_bytes[data_bytes_count++] = value >> 8;
     }
-    return (uint16_t)imm;
+    data_bytes[data_bytes_count++] = value & 0xFF;
+    data_block->size += size;
 }
 
-static void add_opcode(OpcodeArray* opcode_array, uint16_t opcode, int memory_offset) {
-    if (opcode_array->count >= opcode_array->capacity) {
-        opcode_array->capacity *= 2;
-        opcode_array->opcodes = realloc(opcode_array->opcodes, opcode_array->capacity * sizeof(Opcode));
+static void add_label_alias(int label, int block, int offset) {
+    if (label_aliases_count >= label_aliases_capacity) {
+        label_aliases_capacity = label_aliases_capacity == 0 ? 32 : label_aliases_capacity * 2;
+        label_aliases = realloc(label_aliases, label_aliases_capacity * sizeof(LabelAlias));
     }
-    opcode_array->opcodes[opcode_array->count].value = opcode;
-    opcode_array->opcodes[opcode_array->count].memory_offset = memory_offset;
-    opcode_array->count++;
+    label_aliases[label_aliases_count].label = label;
+    label_aliases[label_aliases_count].block = block;
+    label_aliases[label_aliases_count].offset = offset;
+    label_aliases_count++;
+
+    // The final address is set once the surviving copy is placed
+    label_definitions[label].section = -1;
 }
 
-static void expect_token(Parser* parser, const char* expected) {
-    Token* token = cur_token(parser);
-    if (strlen(token->value) != strlen(expected) || strcmp(token->value, expected) != 0) {
-        error(parser, token, "expected '%s', but got '%s'\n", expected, token->value);
+static int compare_block_size(const void* a, const void* b) {
+    const DataBlock* left = &data_blocks[*(const int*)a];
+    const DataBlock* right = &data_blocks[*(const int*)b];
+    if (left->size != right->size) {
+        return right->size - left->size;
     }
-    next_token(parser);
+    return *(const int*)a - *(const int*)b;
 }
 
-static Token* cur_token(Parser* parser) {
-    return &parser->tokens[parser->position];
-}
+// Polynomial hash over the last length bytes of a block, built from the end so the
+// hashes of all suffixes of a block come out of one sweep
+#define SUFFIX_HASH_FACTOR 0x100000001B3ull
 
-static Token* next_token(Parser* parser) {
-    Token* token = cur_token(parser);
-    
-    if (parser->position >= parser->count) {
-        return NULL;
+typedef struct {
+    uint64_t hash;
+    int block;          // block + 1, 0 = empty slot
+    int offset;
+} SuffixSlot;
+
+// Longest blocks first: a block is merged into a kept block that holds the same bytes
+// or ends with them, otherwise it is kept and all its suffixes become merge targets.
+static void merge_data_blocks(void) {
+    int* order = malloc((data_blocks_count > 0 ? data_blocks_count : 1) * sizeof(int));
+    int order_count = 0;
+    int eligible_bytes = 0;
+    for (int i = 0; i < data_blocks_count; i++) {
+        if (data_blocks[i].eligible && data_blocks[i].size > 0) {
+            order[order_count++] = i;
+            eligible_bytes += data_blocks[i].size;
+        }
     }
+    qsort(order, order_count, sizeof(int), compare_block_size);
 
-    if (is_eof_token(token)) {
-        return token;
+    uint32_t capacity = 16;
+    while (capacity < (uint32_t)eligible_bytes * 2) {
+        capacity *= 2;
     }
+    SuffixSlot* slots = calloc(capacity, sizeof(SuffixSlot));
 
-    parser->position++;
-    return token;
-}
-
-static bool is_eof_token(Token* token) {
-    return strcmp(token->value, "EOF") == 0;
-}
-
-static bool is_register(const char* value) {
-    if (strlen(value) != 2) {
-        return false;
-    }
-    return value[0] == 'V' && (value[1] >= '0' && value[1] <= 'F');
-}
+    for (int i = 0; i < order_count; i++) {
+        DataBlock* data_block = &data_blocks[order[i]];
+        const uint8_t* bytes = data_bytes + data_block->start;
 
-static int is_immediate(const char* value) {
-    int start = 0;
-    int base = 10;
+        uint64_t hash = 0;
+        uint64_t factor = 1;
+        for (int j = data_block->size - 1; j >= 0; j--) {
+            hash += (bytes[j] + 1) * factor;
+            factor *= SUFFIX_HASH_FACTOR;
+        }
 
-    if (value[0] == '0') {
-        if (value[1] == 'x' || value[1] == 'X') {
-            start = 2;
-            base = 16;
+        uint32_t index = (uint32_t)(hash ^ (hash >> 32)) & (capacity - 1);
+        while (slots[index].block != 0) {
+            DataBlock* kept = &data_blocks[slots[index].block - 1];
+            if (slots[index].hash == hash && kept->size - slots[index].offset == data_block->size
+                && memcmp(data_bytes + kept->start + slots[index].offset, bytes, data_block->size) == 0) {
+                data_block->alias = slots[index].block - 1;
+                data_block->alias_offset = slots[index].offset;
+                break;
+            }
+            index = (index + 1) & (capacity - 1);
         }
-        else if (value[1] == 'b' || value[1] == 'B') {
-            start = 2;
-            base = 2;
+        if (data_block->alias != -1) {
+            continue;
         }
-    }
 
-    for (int i = start; value[i] != '\0'; i++) {
-        if ((base == 16 && !isxdigit(value[i])) || (base == 10 && !isdigit(value[i])) || (base == 2 && (value[i] != '0' && value[i] != '1'))) {
-            return 0;
+        hash = 0;
+        factor = 1;
+        for (int j = data_block->size - 1; j >= 0; j--) {
+            hash += (bytes[j] + 1) * factor;
+            factor *= SUFFIX_HASH_FACTOR;
+
+            index = (uint32_t)(hash ^ (hash >> 32)) & (capacity - 1);
+            while (slots[index].block != 0) {
+                index = (index + 1) & (capacity - 1);
+            }
+            slots[index].hash = hash;
+            slots[index].block = order[i] + 1;
+            slots[index].offset = j;
         }
     }
-    return base;
+
+    free(slots);
+    free(order);
 }
 
-static int find_label_memory_offset(const char* label) {
-    for (int i = 0; i < label_definitions_count; i++) {
-        if (strcmp(label, label_definitions[i].name) == 0) {
-            return label_definitions[i].memory_offset;
-        }
+// Points the labels of merged blocks at the surviving copy, once sections are placed
+static void resolve_label_aliases(void) {
+    for (int i = 0; i < label_aliases_count; i++) {
+        DataBlock* merged = &data_blocks[label_aliases[i].block];
+        DataBlock* kept = &data_blocks[merged->alias];
+        int address = kept->memory_offset + (kept->section != -1 ? sections[kept->section].base : 0);
+        label_definitions[label_aliases[i].label].memory_offset = address + merged->alias_offset + label_aliases[i].offset;
     }
-    return -1;
 }
 
-static int find_label_index(const char* label) {
-    for (int i = 0; i < label_definitions_count; i++) {
-        if (strcmp(label, label_definitions[i].name) == 0) {
-            return i;
-        }
+/*********************************************************************************
+* Superoptimizer windows
+*********************************************************************************/
+
+// Returns true if the instruction was replaced by (or is part of) an applied window
+static bool superopt_instruction(Parser* parser, Token* token, uint16_t opcode) {
+    int instruction = parser->instructions_seen++;
+    bool after_skip = parser->after_skip;
+    parser->after_skip = is_skip(opcode);
+
+    if (parser->superopt == SUPEROPT_SCAN) {
+        scan_instruction(parser, instruction, opcode, after_skip);
+        return false;
     }
-    return -1;
-}
 
-static uint16_t handle_ld_v(Parser* parser, Token* token_first_param, Token* token_second_param) {
-    uint8_t register_x = token_first_param->value[1] - '0';
-    uint16_t opcode;
+    if (parser->elided_instructions > 0) {
+        parser->elided_instructions--;
+        return true;
+    }
 
-    if (token_second_param->value[0] == 'V') {
-        // 8xy0 - LD Vx, Vy
-        uint8_t register_y = token_second_param->value[1] - '0';
-        opcode = 0x8000 | (register_x << 8) | (register_y << 4);
+    while (parser->window < windows_count && windows[parser->window].first < instruction) {
+        parser->window++;
     }
-    else if (is_immediate(token_second_param->value)) {
-        // 6xkk - LD Vx, byte
-        uint8_t byte = parse_immediate(parser, token_second_param);
-        opcode = 0x6000 | (register_x << 8) | byte;
+    if (parser->window >= windows_count || windows[parser->window].first != instruction) {
+        return false;
     }
-    else if (strcmp(token_second_param->value, "DT") == 0) {
-        // Fx07 - LD Vx, DT
-        opcode = 0xF000 | (register_x << 8) | 0x07;
+
+    Window* window = &windows[parser->window++];
+    if (window->rewrite_length >= window->length || window->opcodes[0] != opcode) {
+        return false; // Nothing shorter, or the program took a different path than in the scan
     }
-    else if (strcmp(token_second_param->value, "K") == 0) {
-        // Fx0A - LD Vx, K
-        opcode = 0xF000 | (register_x << 8) | 0x0A;
+    if (parser->pass == 2) {
+        add_moved_range(parser->memory_offset + 1, parser->memory_offset + 2 * window->rewrite_length, "--superopt");
     }
-    else if (strcmp(token_second_param->value, "[I]") == 0) {
-        // Fx65 - LD Vx, [I]
-        opcode = 0xF000 | (register_x << 8) | 0x65;
+    for (int i = 0; i < window->rewrite_length; i++) {
+        emit(parser, token, window->rewrite[i], 2);
     }
-    else {
-        error(parser, token_second_param, "invalid second LD parameter '%s'\n", token_second_param->value);
-        return NULL;
+    parser->elided_instructions = window->length - 1;
+    return true;
+}
+
+// Operands have to be known in the scan already, so they are the same in every pass
+static void scan_instruction(Parser* parser, int instruction, uint16_t opcode, bool after_skip) {
+    bool eligible = is_superopt_candidate(opcode) && parser->operand_constant && !after_skip;
+
+    if (parser->window != -1) {
+        Window* window = &windows[parser->window];
+        if (!eligible || parser->first_pending_label != -1 || parser->section != window->section
+            || parser->memory_offset != window->memory_offset + 2 * window->length || window->length == SUPEROPT_MAX_WINDOW) {
+            parser->window = -1;
+        }
+    }
+    if (!eligible) {
+        return;
     }
 
-    return opcode;
-}
+    if (parser->window == -1) {
+        if (windows_count >= windows_capacity) {
+            windows_capacity = windows_capacity == 0 ? 64 : windows_capacity * 2;
+            windows = realloc(windows, windows_capacity * sizeof(Window));
+        }
+        parser->window = windows_count++;
+        Window* window = &windows[parser->window];
+        window->first = instruction;
+        window->length = 0;
+        window->rewrite_length = 0;
+        window->memory_offset = parser->memory_offset;
+        window->section = parser->section;
+    }
 
-static uint16_t handle_ld_i(Parser* parser, Token* token_first_param, Token* token_second_param) {
-    uint16_t address = parse_immediate(parser, token_second_param);
-    uint16_t opcode = 0xA000 | address;
-    return opcode;
+    Window* window = &windows[parser->window];
+    window->opcodes[window->length++] = opcode;
 }
 
-static uint16_t handle_ld_f(Token* token_first_param, Token* token_second_param) {
-    uint8_t register_x = token_second_param->value[1] - '0';
-    uint16_t opcode = 0xF000 | (register_x << 8) | 0x29;
-    return opcode;
+static void add_location_span(Parser* parser, const Expression* expression) {
+    if (location_spans_count >= location_spans_capacity) {
+        location_spans_capacity = location_spans_capacity == 0 ? 16 : location_spans_capacity * 2;
+        location_spans = realloc(location_spans, location_spans_capacity * sizeof(LocationSpan));
+    }
+    LocationSpan* span = &location_spans[location_spans_count++];
+    span->start = parser->memory_offset < expression->value ? parser->memory_offset : (int)expression->value;
+    span->end = parser->memory_offset < expression->value ? (int)expression->value : parser->memory_offset;
+    span->section = parser->section;
 }
 
-static uint16_t handle_ld_b(Token* token_first_param, Token* token_second_param) {
-    uint8_t register_x = token_second_param->value[1] - '0';
-    uint16_t opcode = 0xF000 | (register_x << 8) | 0x33;
-    return opcode;
-}
+// Looks up or searches the shortest equivalent of every window. Windows inside the
+// span of a $ expression are kept as they are.
+static void optimize_windows(Parser* parser) {
+    RewriteTable* table = load_rewrite_table(parser->superopt_table);
 
-static uint16_t handle_ld_dt(Token* token_first_param, Token* token_second_param) {
-    uint8_t register_x = token_second_param->value[1] - '0';
-    uint16_t opcode = 0xF000 | (register_x << 8) | 0x15;
-    return opcode;
+    for (int i = 0; i < windows_count; i++) {
+        Window* window = &windows[i];
+        window->rewrite_length = window->length;
+
+        bool spanned = false;
+        int end = window->memory_offset + 2 * window->length;
+        for (int j = 0; j < location_spans_count && !spanned; j++) {
+            LocationSpan* span = &location_spans[j];
+            spanned = span->section == window->section && span->start < end && span->end > window->memory_offset;
+        }
+        if (spanned) {
+            continue;
+        }
+
+        bool searched;
+        window->rewrite_length = superoptimize(table, window->opcodes, window->length, window->rewrite, &searched);
+        parser->windows_searched += searched;
+    }
+
+    if (!save_rewrite_table(table)) {
+        report(SEVERITY_WARNING, DIAGNOSTIC_IO, NULL, 0, 0, "could not write rewrite table '%s'", parser->superopt_table);
+    }
+    free_rewrite_table(table);
 }
 
-static uint16_t handle_ld_st(Token* token_first_param, Token* token_second_param) {
-    uint8_t register_x = token_second_param->value[1] - '0';
-    uint16_t opcode = 0xF000 | (register_x << 8) | 0x18;
-    return opcode;
+// SE, SNE, SKP and SKNP
+static bool is_skip(uint16_t opcode) {
+    switch (opcode >> 12) {
+    case 0x3:
+    case 0x4:
+        return true;
+    case 0x5:
+    case 0x9:
+        return (opcode & 0xF) == 0;
+    case 0xE:
+        return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
+    default:
+        return false;
+    }
 }
 
-static uint16_t handle_ld_i_addr(Parser* parser, Token* token_first_param, Token* token_second_param) {
-    uint8_t register_x = token_second_param->value[1] - '0';
-    uint16_t opcode;
+static void add_moved_range(int first, int end, const char* option) {
+    if (moved_ranges_count >= moved_ranges_capacity) {
+        moved_ranges_capacity = moved_ranges_capacity == 0 ? 16 : moved_ranges_capacity * 2;
+        moved_ranges = realloc(moved_ranges, moved_ranges_capacity * sizeof(MovedRange));
+    }
+    MovedRange* range = &moved_ranges[moved_ranges_count++];
+    range->first = first;
+    range->end = end;
+    range->option = option;
+}
 
-    if (strcmp(token_first_param->value, "[I]") == 0 && token_second_param->value[0] == 'V') {
-        opcode = 0xF000 | (register_x << 8) | 0x55;
+static void add_address_reference(Parser* parser, Token* token, int base, int target) {
+    if (parser->pass != 2 || (parser->dedup == DEDUP_OFF && parser->superopt == SUPEROPT_OFF)) {
+        return;
     }
-    else if (token_second_param->value[0] == 'V' && strcmp(token_first_param->value, "V") == 0) {
-        opcode = 0xF000 | (register_x << 8) | 0x65;
+    if ((base == -1 ? target : base) < PROGRAM_START) {
+        return; // Interpreter memory (font) never moves
     }
-    else {
-        error(parser, token_second_param, "invalid second LD parameter '%s'\n", token_second_param->value);
-        return NULL;
+    if (address_references_count >= address_references_capacity) {
+        address_references_capacity = address_references_capacity == 0 ? 16 : address_references_capacity * 2;
+        address_references = realloc(address_references, address_references_capacity * sizeof(AddressReference));
     }
-
-    return opcode;
+    AddressReference* reference = &address_references[address_references_count++];
+    reference->source_offset = token->offset;
+    reference->base = base;
+    reference->target = target;
 }
 
-void free_opcode_array(OpcodeArray* opcode_array) {
-    free(opcode_array->opcodes);
+// Dedup and the superoptimizer keep labels correct, an address computed in another way
+// is wrong once it reaches across moved code. Absolute addresses count from the start
+// of the code block around them, JP V0 can reach up to the next label.
+static void check_address_references(Parser* parser) {
+    for (int i = 0; i < address_references_count; i++) {
+        AddressReference* reference = &address_references[i];
+        int base = reference->base;
+        int target = reference->target;
+        if (target == -1) {
+            target = base + 0xFF;
+            for (int j = 0; j < label_definitions_count; j++) {
+                int address = label_definitions[j].memory_offset;
+                if (address > base && address - 1 < target) {
+                    target = address - 1;
+                }
+            }
+        }
+        else if (base == -1) {
+            base = target;
+            while (base > PROGRAM_START && is_memory_used(base - 1)) {
+                base--;
+            }
+        }
+
+        for (int j = 0; j < moved_ranges_count; j++) {
+            MovedRange* range = &moved_ranges[j];
+            bool crossed = base <= target ? base < range->first && range->first <= target : target < range->end && range->end <= base;
+            if (!crossed) {
+                continue;
+            }
+            if (reference->target == -1) {
+                warning(parser, reference->source_offset, DIAGNOSTIC_OPTIMIZATION, "JP V0 table at 0x%03X holds code moved by %s\n", base, range->option);
+            }
+            else {
+                warning(parser, reference->source_offset, DIAGNOSTIC_OPTIMIZATION, "address 0x%03X is not a label and may point to code moved by %s\n", reference->target, range->option);
+            }
+            break;
+        }
+    }
 }
 
 /*********************************************************************************
@@ -453,44 +2068,14 @@ static uint16_t handle_ret(Parser* parser) {
 static uint16_t handle_sys(Parser* parser) {
     Token* token = next_token(parser);
     uint16_t opcode = 0x0000;
-
-    if (is_immediate(token->value)) {
-        uint16_t address = parse_immediate(parser, token);
-        opcode |= address;
-    }
-    else {
-        int label_index = find_label_index(token->value);
-
-        if (label_index == -1) {
-            error(parser, token, "label '%s' not found\n", token->value);
-            return NULL;
-        }
-
-        opcode |= label_definitions[label_index].memory_offset & 0x0FFF;
-    }
-
+    opcode |= parse_operand(parser, token, FIELD_ADDRESS);
     return opcode;
 }
 
 static uint16_t handle_call(Parser* parser) {
     Token* token = next_token(parser);
     uint16_t opcode = 0x2000;
-
-    if (is_immediate(token->value)) {
-        uint16_t address = parse_immediate(parser, token);
-        opcode |= address;
-    }
-    else {
-        int label_index = find_label_index(token->value);
-
-        if (label_index == -1) {
-            error(parser, token, "label '%s' not found\n", token->value);
-            return NULL;
-        }
-
-        opcode |= label_definitions[label_index].memory_offset & 0x0FFF;
-    }
-
+    opcode |= parse_operand(parser, token, FIELD_ADDRESS);
     return opcode;
 }
 
@@ -499,44 +2084,40 @@ static uint16_t handle_jp(Parser* parser) {
     uint16_t opcode = 0x1000;
 
     if (token->value[0] == 'V') {
-        if (token->value[1] == '0' && token->value[2] == ',') {
+        if (strcmp(token->value, "V0") == 0) {
             opcode = 0xB000;
-            expect_token(parser, ',');
+            expect_token(parser, ",");
             token = next_token(parser);
         }
         else {
-            error(parser, token, "only register V0 is allowed for JP instruction\n");
-            return NULL;
-        }
-    }
-
-    if (is_immediate(token->value)) {
-        uint16_t address = parse_immediate(parser, token);
-        if (address > 0xFFF) {
-            error(parser, token, "address (0x%X) exceeds the 12-bit address space\n", token->value);
-            return NULL;
+            error(parser, token, DIAGNOSTIC_SYNTAX, "only register V0 is allowed for JP instruction\n");
+            return 0;
         }
-        opcode |= address;
     }
-    else {
-        int label_index = find_label_index(token->value);
 
-        if (label_index == -1) {
-            error(parser, token, "label '%s' not found\n", token->value);
-            return NULL;
-        }
-
-        opcode |= label_definitions[label_index].memory_offset & 0x0FFF;
+    opcode |= parse_operand(parser, token, FIELD_ADDRESS);
+    if ((opcode >> 12) == 0xB) {
+        add_address_reference(parser, token, opcode & 0xFFF, -1);
     }
-
     return opcode;
 }
 
 static uint16_t handle_se(Parser* parser) {
-    uint16_t opcode = 0x3000;
-    opcode |= parse_register(parser, cur_token(parser)) << 8;
+    uint16_t opcode;
+
+    Token* token = next_token(parser);
+    uint16_t vx = parse_register(parser, token) << 8;
+
     expect_token(parser, ",");
-    opcode |= parse_immediate(parser, cur_token(parser));
+
+    token = next_token(parser);
+    if (is_register(token->value)) {
+        opcode = 0x5000 | vx | (parse_register(parser, token) << 4);
+    }
+    else {
+        opcode = 0x3000 | vx | parse_operand(parser, token, FIELD_BYTE);
+    }
+
     return opcode;
 }
 
@@ -553,9 +2134,17 @@ static uint16_t handle_ld(Parser* parser) {
     if (token_first_param->value[0] == 'V') {
         opcode = handle_ld_v(parser, token_first_param, token_second_param);
     }
-    else if (token_first_param->value[0] == 'I') {
+    else if (strcmp(token_first_param->value, "I") == 0) {
         opcode = handle_ld_i(parser, token_first_param, token_second_param);
     }
+    else if (strcmp(token_first_param->value, "HF") == 0) {
+        // Fx30 - LD HF, Vx
+        opcode = require_target(parser, token_first_param, TARGET_SCHIP) ? 0xF030 | (parse_register(parser, token_second_param) << 8) : 0;
+    }
+    else if (strcmp(token_first_param->value, "R") == 0) {
+        // Fx75 - LD R, Vx
+        opcode = require_target(parser, token_first_param, TARGET_SCHIP) ? 0xF075 | (parse_register(parser, token_second_param) << 8) : 0;
+    }
     else if (token_first_param->value[0] == 'F') {
         opcode = handle_ld_f(token_first_param, token_second_param);
     }
@@ -572,8 +2161,8 @@ static uint16_t handle_ld(Parser* parser) {
         opcode = handle_ld_i_addr(parser, token_first_param, token_second_param);
     }
     else {
-        error(parser, token_first_param, "invalid first LD parameter '%s'\n", token_first_param->value);
-        return NULL;
+        error(parser, token_first_param, DIAGNOSTIC_SYNTAX, "invalid first LD parameter '%s'\n", token_first_param->value);
+        return 0;
     }
 
     return opcode;
@@ -593,9 +2182,9 @@ static uint16_t handle_add(Parser* parser) {
         uint16_t y_register = parse_register(parser, token_second_param);
         opcode = 0x8004 | (x_register << 8) | (y_register << 4);
     }
-    else if (is_register(token_first_param->value) && is_immediate(token_second_param->value)) {
+    else if (is_register(token_first_param->value)) {
         uint16_t x_register = parse_register(parser, token_first_param);
-        uint16_t immediate = parse_immediate(parser, token_second_param);
+        uint16_t immediate = parse_operand(parser, token_second_param, FIELD_BYTE);
         opcode = 0x7000 | (x_register << 8) | immediate;
     }
     else if (strcmp(token_first_param->value, "I") == 0 && is_register(token_second_param->value)) {
@@ -603,7 +2192,7 @@ static uint16_t handle_add(Parser* parser) {
         opcode = 0xF01E | (x_register << 8);
     }
     else {
-        error(parser, token_first_param, "invalid ADD parameters '%s' and '%s'\n", token_first_param->value, token_second_param->value);
+        error(parser, token_first_param, DIAGNOSTIC_SYNTAX, "invalid ADD parameters '%s' and '%s'\n", token_first_param->value, token_second_param->value);
         return 0;
     }
 
@@ -614,7 +2203,7 @@ static uint16_t handle_sne(Parser* parser) {
     uint16_t opcode;
 
     Token* token = next_token(parser);
-    uint8_t vx = parse_register(parser, token) << 8;
+    uint16_t vx = parse_register(parser, token) << 8;
 
     expect_token(parser, ",");
 
@@ -622,12 +2211,8 @@ static uint16_t handle_sne(Parser* parser) {
     if (is_register(token->value)) {
         opcode = 0x9000 | vx | (parse_register(parser, token) << 4);
     }
-    else if (is_immediate(token->value)) {
-        opcode = 0x4000 | vx | parse_immediate(parser, token);
-    }
     else {
-        error(parser, token, "unexpected operand '%s' for instruction SNE\n", token->value);
-        return NULL;
+        opcode = 0x4000 | vx | parse_operand(parser, token, FIELD_BYTE);
     }
 
     return opcode;
@@ -660,12 +2245,12 @@ static uint16_t handle_rnd(Parser* parser) {
     uint16_t opcode = 0xC000;
 
     Token* token = next_token(parser);
-    uint8_t vx = parse_register(parser, token) << 8;
+    uint16_t vx = parse_register(parser, token) << 8;
 
     expect_token(parser, ",");
 
     token = next_token(parser);
-    opcode |= vx | parse_immediate(parser, token);
+    opcode |= vx | parse_operand(parser, token, FIELD_BYTE);
 
     return opcode;
 }
@@ -675,8 +2260,8 @@ static uint16_t handle_drw(Parser* parser) {
 
     Token* token = next_token(parser);
 
-    uint8_t vx = parse_register(parser, token) << 8;
-    uint8_t vy;
+    uint16_t vx = parse_register(parser, token) << 8;
+    uint16_t vy;
 
     expect_token(parser, ",");
 
@@ -686,7 +2271,7 @@ static uint16_t handle_drw(Parser* parser) {
     expect_token(parser, ",");
 
     token = next_token(parser);
-    uint8_t nibble = parse_immediate(parser, token) & 0x0F;
+    uint8_t nibble = parse_operand(parser, token, FIELD_NIBBLE);
 
     opcode |= vx | vy | nibble;
 
@@ -696,8 +2281,8 @@ static uint16_t handle_drw(Parser* parser) {
 static uint16_t handle_shl_shr(Parser* parser, const char* type) {
     Token* token = next_token(parser);
     if (token->value[0] != 'V') {
-        error(parser, token, "expected 'V' for register in %s instruction\n", type);
-        return NULL;
+        error(parser, token, DIAGNOSTIC_INVALID_REGISTER, "expected 'V' for register in %s instruction\n", type);
+        return 0;
     }
 
     uint8_t vx = parse_register(parser, token);
@@ -708,8 +2293,8 @@ static uint16_t handle_shl_shr(Parser* parser, const char* type) {
         expect_token(parser, ",");
         token = next_token(parser);
         if (token->value[0] != 'V') {
-            error(parser, token, "expected 'V' for register in %s instruction\n", type);
-            return NULL;
+            error(parser, token, DIAGNOSTIC_INVALID_REGISTER, "expected 'V' for register in %s instruction\n", type);
+            return 0;
         }
 
         uint8_t vy = parse_register(parser, token);
@@ -718,4 +2303,52 @@ static uint16_t handle_shl_shr(Parser* parser, const char* type) {
 
     opcode |= (vx << 8);
     return opcode;
-}
\ No newline at end of file
+}
+
+static uint16_t handle_ld_i_long(Parser* parser, Token* token) {
+    // F000 nnnn - LD I, LONG addr
+    Token* address_token = next_token(parser);
+    uint16_t address = parse_operand(parser, address_token, FIELD_LONG_ADDRESS);
+    if (!require_target(parser, token, TARGET_XOCHIP)) {
+        return 0;
+    }
+    parser->long_operand = address;
+    parser->has_long_operand = true;
+    return 0xF000;
+}
+
+static uint16_t handle_scroll(Parser* parser, Token* token, uint16_t opcode, Target target) {
+    opcode |= parse_operand(parser, next_token(parser), FIELD_NIBBLE);
+    return require_target(parser, token, target) ? opcode : 0;
+}
+
+static uint16_t handle_save_load(Parser* parser, uint8_t instruction) {
+    uint16_t opcode = 0x5000 | instruction;
+
+    Token* token = next_token(parser);
+    opcode |= parse_register(parser, token) << 8;
+
+    expect_token(parser, ",");
+
+    token = next_token(parser);
+    opcode |= parse_register(parser, token) << 4;
+
+    return opcode;
+}
+
+static uint16_t handle_plane(Parser* parser) {
+    Token* token = next_token(parser);
+    uint16_t plane = parse_operand(parser, token, FIELD_NIBBLE);
+    if (plane > 3) {
+        error(parser, token, DIAGNOSTIC_OUT_OF_RANGE, "plane mask %d exceeds the maximum of 3\n", plane);
+        return 0;
+    }
+    return 0xF001 | (plane << 8);
+}
+
+static uint16_t handle_fx_instruction(Parser* parser, uint8_t instruction) {
+    uint16_t opcode = 0xF000 | instruction;
+    Token* token = next_token(parser);
+    opcode |= parse_register(parser, token) << 8;
+    return opcode;
+}
@@ -1,8 +1,11 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "lexer.h"
+
 /*
 * Chip 8 opcodes:
 * 
@@ -43,11 +46,60 @@
 *           Cxkk - RND Vx, byte
 *           Dxyn - DRW Vx, Vy, nibble
 *
+* SUPER-CHIP opcodes:
+*
+*           00Cn - SCD nibble
+*           00FB - SCR
+*           00FC - SCL
+*           00FD - EXIT
+*           00FE - LOW
+*           00FF - HIGH
+*           Dxy0 - DRW Vx, Vy, 0
+*           Fx30 - LD HF, Vx
+*           Fx75 - LD R, Vx
+*           Fx85 - LD Vx, R
+*
+* XO-CHIP opcodes:
+*
+*           00Dn - SCU nibble
+*           5xy2 - SAVE Vx, Vy
+*           5xy3 - LOAD Vx, Vy
+*           F000 - LD I, LONG addr (followed by a 16-bit address)
+*           Fn01 - PLANE n
+*           F002 - AUDIO
+*           Fx3A - PITCH Vx
+*
 */
 
+// Instruction set and address space. Each target is a superset of the previous one.
+typedef enum {
+    TARGET_CHIP8,
+    TARGET_SCHIP,
+    TARGET_XOCHIP,
+} Target;
+
+typedef struct {
+    Target target;
+    bool print_map;     // print the memory layout (sections, free space) after parsing
+    bool dedup;         // merge identical data blocks and blocks that are suffixes of others
+    const char* superopt_table; // rewrite table of the superoptimizer, NULL to disable it
+} ParseOptions;
+
+#define MAX_LABEL_LENGTH 32
+
+typedef struct {
+    char name[MAX_LABEL_LENGTH];
+    uint32_t hash;
+    int memory_offset;
+    int section;        // section the label was defined in, -1 for ORG code
+    bool global;        // exported to other objects with GLOBAL
+} LabelDefinition;
+
 typedef struct {
     uint16_t value;
     int memory_offset;
+    int size;           // 2 for opcodes and DW words, 1 for DB bytes
+    int source_offset;  // offset of the statement in the source, for line information
 } Opcode;
 
 typedef struct {
@@ -56,7 +108,46 @@ typedef struct {
     int capacity;
 } OpcodeArray;
 
-bool parse(TokenArray* token_array, OpcodeArray* opcode_array);
+typedef enum {
+    RELOCATION_ADDRESS12,   // low 12 bits of the opcode (JP, CALL, SYS, LD I)
+    RELOCATION_ADDRESS16,   // the whole word (address following F000)
+} RelocationKind;
+
+// Address field of the opcode at memory_offset refers to a label. Local references
+// (empty symbol) already hold the assembled address and only need to be rebased,
+// references to undefined labels hold 0 and are resolved by the linker.
+typedef struct {
+    int memory_offset;
+    RelocationKind kind;
+    char symbol[MAX_LABEL_LENGTH];
+} Relocation;
+
+typedef struct {
+    Relocation* relocations;
+    int count;
+    int capacity;
+} RelocationArray;
+
+// Savings of --dedup and --superopt. Objects keep them, so a cached object reports
+// the same as the assembly that produced it.
+typedef struct {
+    int data_blocks_merged;
+    int data_bytes_saved;
+    int windows;
+    int windows_rewritten;
+    int window_bytes_saved;
+    int windows_searched;   // windows the rewrite table had no entry for
+} OptimizationStats;
+
+bool parse(TokenArray* token_array, const ParseOptions* options, OpcodeArray* opcode_array);
+bool parse_relocatable(TokenArray* token_array, const ParseOptions* options, OpcodeArray* opcode_array, RelocationArray* relocation_array);
+int target_max_address(Target target);
+int get_label_definitions(const LabelDefinition** labels);
+// Stats of the last parse
+void get_optimization_stats(OptimizationStats* stats);
+// Prints the summary lines of the optimizations enabled in options
+void print_optimization_stats(const char* filename, const ParseOptions* options, const OptimizationStats* stats);
 void free_opcode_array(OpcodeArray* opcode_array);
+void free_relocation_array(RelocationArray* relocation_array);
 
 #endif // PARSER_H
\ No newline at end of file
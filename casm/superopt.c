@@ -0,0 +1,556 @@
+#if defined(_MSC_VER) || defined(__STDC_LIB_EXT1__)
+#define _CRT_SECURE_NO_WARNINGS
+#pragma warning(disable: 4996)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "superopt.h"
+
+#define REWRITE_TABLE_HEADER "casm superopt 1"
+
+#define QUICK_STATES 8              // states every candidate is run on
+#define RANDOM_STATES 4096          // random states of the final check
+#define MAX_CONSTANTS 24
+#define MAX_CANDIDATES (9 * 16 * 16 + 2 * 16 * MAX_CONSTANTS)
+#define SEARCH_LIMIT (1u << 25)     // sequences of one length, longer searches are skipped
+
+// Interpreter differences in the ALU instructions, a rewrite has to hold under all
+// combinations
+#define QUIRK_LOGIC_CLEARS_VF 1     // 8xy1, 8xy2, 8xy3 set VF to 0
+#define QUIRK_SHIFT_READS_VY 2      // 8xy6, 8xyE shift VY into VX
+#define QUIRK_COMBINATIONS 4
+
+typedef struct {
+    uint16_t window[SUPEROPT_MAX_WINDOW];
+    uint8_t length;                 // 0 = empty slot
+    uint8_t rewrite_length;
+    uint16_t rewrite[SUPEROPT_MAX_WINDOW];
+} Rewrite;
+
+struct RewriteTable {
+    char* path;
+    Rewrite* slots;
+    uint32_t capacity;
+    uint32_t count;
+    bool modified;
+};
+
+typedef struct {
+    const uint16_t* window;
+    int length;
+    uint16_t register_mask;         // registers the window reads or writes
+    uint8_t quick[QUICK_STATES][16];
+    uint8_t expected[QUICK_STATES][16];
+    uint16_t candidates[MAX_CANDIDATES];
+    int candidate_count;
+} Search;
+
+static void execute(uint8_t* v, uint16_t opcode, int quirks);
+static void execute_sequence(uint8_t* v, const uint16_t* sequence, int length, int quirks);
+static uint16_t opcode_registers(uint16_t opcode);
+static void prepare_search(Search* search, const uint16_t* window, int length);
+static void generate_candidates(Search* search);
+static bool search_length(const Search* search, int length, uint16_t* rewrite);
+static bool extend_sequence(const Search* search, uint16_t* sequence, int depth, int length, uint8_t states[][16], int first, int end);
+static bool verify_sequence(const Search* search, const uint16_t* sequence, int length);
+static bool check_state(const Search* search, const uint16_t* sequence, int length, const uint8_t* state);
+static uint32_t next_random(uint32_t* state);
+static Rewrite* find_rewrite(RewriteTable* table, const uint16_t* window, int length);
+static void insert_rewrite(RewriteTable* table, const Rewrite* rewrite);
+static void parse_rewrite_line(RewriteTable* table, char* line);
+
+RewriteTable* load_rewrite_table(const char* path) {
+    RewriteTable* table = calloc(1, sizeof(RewriteTable));
+    table->path = malloc(strlen(path) + 1);
+    strcpy(table->path, path);
+    table->capacity = 256;
+    table->slots = calloc(table->capacity, sizeof(Rewrite));
+
+    char* text = read_file(path, NULL);
+    if (text == NULL) {
+        return table;
+    }
+
+    // A table of another version may hold results of a different search
+    char* line = strtok(text, "\n");
+    if (line != NULL && strncmp(line, REWRITE_TABLE_HEADER, strlen(REWRITE_TABLE_HEADER)) == 0) {
+        while ((line = strtok(NULL, "\n")) != NULL) {
+            parse_rewrite_line(table, line);
+        }
+    }
+
+    free(text);
+    return table;
+}
+
+bool save_rewrite_table(RewriteTable* table) {
+    if (!table->modified) {
+        return true;
+    }
+
+    // Up to 2 * SUPEROPT_MAX_WINDOW opcodes of 5 characters and " =\n" per entry
+    size_t capacity = strlen(REWRITE_TABLE_HEADER) + 2 + table->count * (10 * SUPEROPT_MAX_WINDOW + 4);
+    char* text = malloc(capacity);
+    size_t size = sprintf(text, "%s\n", REWRITE_TABLE_HEADER);
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        Rewrite* rewrite = &table->slots[i];
+        if (rewrite->length == 0) {
+            continue;
+        }
+        for (int j = 0; j < rewrite->length; j++) {
+            size += sprintf(text + size, "%04X ", rewrite->window[j]);
+        }
+        text[size++] = '=';
+        for (int j = 0; j < rewrite->rewrite_length; j++) {
+            size += sprintf(text + size, " %04X", rewrite->rewrite[j]);
+        }
+        text[size++] = '\n';
+    }
+
+    bool success = write_file_atomic(table->path, text, size);
+    free(text);
+    table->modified = !success;
+    return success;
+}
+
+void free_rewrite_table(RewriteTable* table) {
+    free(table->slots);
+    free(table->path);
+    free(table);
+}
+
+bool is_superopt_candidate(uint16_t opcode) {
+    switch (opcode >> 12) {
+    case 0x6:
+    case 0x7:
+        return true;
+    case 0x8:
+        return (opcode & 0xF) <= 0x7 || (opcode & 0xF) == 0xE;
+    default:
+        return false;
+    }
+}
+
+int superoptimize(RewriteTable* table, const uint16_t* window, int length, uint16_t* rewrite, bool* searched) {
+    Search* search = malloc(sizeof(Search));
+    prepare_search(search, window, length);
+
+    // Entries are checked again, the table is a plain text file
+    *searched = false;
+    Rewrite* known = find_rewrite(table, window, length);
+    if (known != NULL && (known->rewrite_length >= length || verify_sequence(search, known->rewrite, known->rewrite_length))) {
+        int rewrite_length = known->rewrite_length < length ? known->rewrite_length : length;
+        memcpy(rewrite, rewrite_length < length ? known->rewrite : window, rewrite_length * sizeof(uint16_t));
+        free(search);
+        return rewrite_length;
+    }
+    *searched = true;
+
+    int rewrite_length = length;
+    memcpy(rewrite, window, length * sizeof(uint16_t));
+    if (length > 1) {
+        generate_candidates(search);
+    }
+    for (int i = 0; i < length && i <= SUPEROPT_MAX_REWRITE; i++) {
+        if (search_length(search, i, rewrite)) {
+            rewrite_length = i;
+            break;
+        }
+    }
+
+    Rewrite entry;
+    memset(&entry, 0, sizeof(Rewrite));
+    memcpy(entry.window, window, length * sizeof(uint16_t));
+    entry.length = (uint8_t)length;
+    memcpy(entry.rewrite, rewrite, rewrite_length * sizeof(uint16_t));
+    entry.rewrite_length = (uint8_t)rewrite_length;
+    insert_rewrite(table, &entry);
+    table->modified = true;
+
+    free(search);
+    return rewrite_length;
+}
+
+/*********************************************************************************
+* Evaluator
+*********************************************************************************/
+
+// Same results as the interpreter in machine.c for quirks 0. VX and VY are read before
+// anything is written, the flag is written last (so it wins for VF as destination).
+static void execute(uint8_t* v, uint16_t opcode, int quirks) {
+    uint8_t x = (opcode >> 8) & 0xF;
+    uint8_t y = (opcode >> 4) & 0xF;
+    uint8_t kk = opcode & 0xFF;
+    uint8_t vx = v[x];
+    uint8_t vy = v[y];
+    uint8_t shifted = (quirks & QUIRK_SHIFT_READS_VY) ? vy : vx;
+
+    switch (opcode >> 12) {
+    case 0x6: v[x] = kk; break;
+    case 0x7: v[x] = vx + kk; break;
+    case 0x8:
+        switch (opcode & 0xF) {
+        case 0x0: v[x] = vy; break;
+        case 0x1: v[x] = vx | vy; if (quirks & QUIRK_LOGIC_CLEARS_VF) v[0xF] = 0; break;
+        case 0x2: v[x] = vx & vy; if (quirks & QUIRK_LOGIC_CLEARS_VF) v[0xF] = 0; break;
+        case 0x3: v[x] = vx ^ vy; if (quirks & QUIRK_LOGIC_CLEARS_VF) v[0xF] = 0; break;
+        case 0x4: v[x] = vx + vy; v[0xF] = (vx + vy) > 0xFF; break;
+        case 0x5: v[x] = vx - vy; v[0xF] = vx >= vy; break;
+        case 0x6: v[x] = shifted >> 1; v[0xF] = shifted & 1; break;
+        case 0x7: v[x] = vy - vx; v[0xF] = vy >= vx; break;
+        case 0xE: v[x] = shifted << 1; v[0xF] = shifted >> 7; break;
+        }
+        break;
+    }
+}
+
+static void execute_sequence(uint8_t* v, const uint16_t* sequence, int length, int quirks) {
+    for (int i = 0; i < length; i++) {
+        execute(v, sequence[i], quirks);
+    }
+}
+
+// Mask of the registers an instruction reads or writes
+static uint16_t opcode_registers(uint16_t opcode) {
+    uint16_t mask = 1 << ((opcode >> 8) & 0xF);
+    if (opcode >> 12 == 0x8) {
+        mask |= 1 << ((opcode >> 4) & 0xF);
+        if ((opcode & 0xF) != 0x0) {
+            mask |= 1 << 0xF;
+        }
+    }
+    return mask;
+}
+
+/*********************************************************************************
+* Search
+*********************************************************************************/
+
+static void prepare_search(Search* search, const uint16_t* window, int length) {
+    search->window = window;
+    search->length = length;
+    search->register_mask = 0;
+    for (int i = 0; i < length; i++) {
+        search->register_mask |= opcode_registers(window[i]);
+    }
+
+    // All zero, all ones, then random states. Fixed seeds keep builds reproducible.
+    uint32_t random = 0x9E3779B9;
+    for (int s = 0; s < QUICK_STATES; s++) {
+        for (int r = 0; r < 16; r++) {
+            search->quick[s][r] = s == 0 ? 0x00 : s == 1 ? 0xFF : (uint8_t)next_random(&random);
+        }
+        memcpy(search->expected[s], search->quick[s], 16);
+        execute_sequence(search->expected[s], window, length, 0);
+    }
+    search->candidate_count = 0;
+}
+
+// Instructions over the registers of the window. Constants are those of the window,
+// final register values that do not depend on the input and constant increments.
+static void generate_candidates(Search* search) {
+    uint8_t constants[MAX_CONSTANTS];
+    int constant_count = 0;
+    bool seen[256] = { false };
+
+    uint8_t values[2 + SUPEROPT_MAX_WINDOW + 32];
+    int value_count = 0;
+    values[value_count++] = 0;
+    values[value_count++] = 1;
+    for (int i = 0; i < search->length; i++) {
+        if (search->window[i] >> 12 != 0x8) {
+            values[value_count++] = search->window[i] & 0xFF;
+        }
+    }
+    for (int r = 0; r < 16; r++) {
+        bool fixed = true;
+        bool offset = true;
+        for (int s = 1; s < QUICK_STATES; s++) {
+            fixed &= search->expected[s][r] == search->expected[0][r];
+            offset &= (uint8_t)(search->expected[s][r] - search->quick[s][r]) == (uint8_t)(search->expected[0][r] - search->quick[0][r]);
+        }
+        if (fixed) {
+            values[value_count++] = search->expected[0][r];
+        }
+        if (offset) {
+            values[value_count++] = (uint8_t)(search->expected[0][r] - search->quick[0][r]);
+        }
+    }
+    for (int i = 0; i < value_count && constant_count < MAX_CONSTANTS; i++) {
+        if (!seen[values[i]]) {
+            seen[values[i]] = true;
+            constants[constant_count++] = values[i];
+        }
+    }
+
+    static const uint8_t operations[] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE };
+    bool writes_flag = (search->register_mask & (1 << 0xF)) != 0;
+    search->candidate_count = 0;
+    for (int x = 0; x < 16; x++) {
+        if (!(search->register_mask & (1 << x))) {
+            continue;
+        }
+        for (int c = 0; c < constant_count; c++) {
+            search->candidates[search->candidate_count++] = 0x6000 | (x << 8) | constants[c];
+            if (constants[c] != 0) {
+                search->candidates[search->candidate_count++] = 0x7000 | (x << 8) | constants[c];
+            }
+        }
+        for (int y = 0; y < 16; y++) {
+            if (!(search->register_mask & (1 << y))) {
+                continue;
+            }
+            for (int o = 0; o < (int)sizeof(operations); o++) {
+                // Only touch VF if the window does, skip moves of a register onto itself
+                if ((operations[o] != 0x0 && !writes_flag) || (x == y && operations[o] <= 0x2)) {
+                    continue;
+                }
+                search->candidates[search->candidate_count++] = 0x8000 | (x << 8) | (y << 4) | operations[o];
+            }
+        }
+    }
+}
+
+// Tries all sequences of the given length in parallel over their first instruction.
+// The first match in candidate order wins, so the result does not depend on timing.
+static bool search_length(const Search* search, int length, uint16_t* rewrite) {
+    if (length == 0) {
+        return verify_sequence(search, NULL, 0);
+    }
+
+    uint64_t sequences = 1;
+    for (int i = 0; i < length; i++) {
+        sequences *= search->candidate_count;
+    }
+    if (search->candidate_count == 0 || sequences > SEARCH_LIMIT) {
+        return false;
+    }
+
+    int count = search->candidate_count;
+    bool* matched = calloc(count, sizeof(bool));
+    uint16_t (*found)[SUPEROPT_MAX_REWRITE] = malloc(count * sizeof(*found));
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < count; i++) {
+        matched[i] = extend_sequence(search, found[i], 0, length, (uint8_t (*)[16])search->quick, i, i + 1);
+    }
+
+    bool success = false;
+    for (int i = 0; i < count && !success; i++) {
+        if (matched[i]) {
+            memcpy(rewrite, found[i], length * sizeof(uint16_t));
+            success = true;
+        }
+    }
+
+    free(found);
+    free(matched);
+    return success;
+}
+
+// Depth first over the candidates first to end at position depth, states holds the
+// quick states after the instructions before it
+static bool extend_sequence(const Search* search, uint16_t* sequence, int depth, int length, uint8_t states[][16], int first, int end) {
+    uint8_t next[QUICK_STATES][16];
+    bool last = depth + 1 == length;
+
+    for (int i = first; i < end; i++) {
+        uint16_t opcode = search->candidates[i];
+        bool match = true;
+        for (int s = 0; s < QUICK_STATES && match; s++) {
+            memcpy(next[s], states[s], 16);
+            execute(next[s], opcode, 0);
+            match = !last || memcmp(next[s], search->expected[s], 16) == 0;
+        }
+        if (!match) {
+            continue;
+        }
+
+        sequence[depth] = opcode;
+        if (last ? verify_sequence(search, sequence, length) : extend_sequence(search, sequence, depth + 1, length, next, 0, search->candidate_count)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Every state of up to two window registers, otherwise all combinations of edge values
+// (for up to four registers) and random states, each under every quirk combination.
+// Other registers keep their value in both sequences and are not varied.
+static bool verify_sequence(const Search* search, const uint16_t* sequence, int length) {
+    for (int i = 0; i < length; i++) {
+        if (!is_superopt_candidate(sequence[i]) || (opcode_registers(sequence[i]) & ~search->register_mask) != 0) {
+            return false;
+        }
+    }
+
+    int registers[16];
+    int register_count = 0;
+    for (int r = 0; r < 16; r++) {
+        if (search->register_mask & (1 << r)) {
+            registers[register_count++] = r;
+        }
+    }
+
+    static const uint8_t edges[] = { 0x00, 0x01, 0x02, 0x7F, 0x80, 0x81, 0xFE, 0xFF };
+    uint8_t state[16];
+    for (int r = 0; r < 16; r++) {
+        state[r] = (uint8_t)(0xA5 + r);
+    }
+
+    if (register_count <= 2) {
+        long total = 1L << (8 * register_count);
+        for (long i = 0; i < total; i++) {
+            for (int r = 0; r < register_count; r++) {
+                state[registers[r]] = (uint8_t)(i >> (8 * r));
+            }
+            if (!check_state(search, sequence, length, state)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (register_count <= 4) {
+        long total = 1L << (3 * register_count);
+        for (long i = 0; i < total; i++) {
+            for (int r = 0; r < register_count; r++) {
+                state[registers[r]] = edges[(i >> (3 * r)) & 7];
+            }
+            if (!check_state(search, sequence, length, state)) {
+                return false;
+            }
+        }
+    }
+
+    uint32_t random = 0x85EBCA6B;
+    for (int i = 0; i < RANDOM_STATES; i++) {
+        for (int r = 0; r < register_count; r++) {
+            state[registers[r]] = (uint8_t)next_random(&random);
+        }
+        if (!check_state(search, sequence, length, state)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool check_state(const Search* search, const uint16_t* sequence, int length, const uint8_t* state) {
+    for (int quirks = 0; quirks < QUIRK_COMBINATIONS; quirks++) {
+        uint8_t original[16];
+        uint8_t rewritten[16];
+        memcpy(original, state, 16);
+        memcpy(rewritten, state, 16);
+        execute_sequence(original, search->window, search->length, quirks);
+        execute_sequence(rewritten, sequence, length, quirks);
+        if (memcmp(original, rewritten, 16) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// xorshift32
+static uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/*********************************************************************************
+* Rewrite table (open addressing, linear probing)
+*********************************************************************************/
+
+static Rewrite* find_rewrite(RewriteTable* table, const uint16_t* window, int length) {
+    uint32_t index = hash_bytes(window, length * sizeof(uint16_t)) & (table->capacity - 1);
+    while (table->slots[index].length != 0) {
+        Rewrite* rewrite = &table->slots[index];
+        if (rewrite->length == length && memcmp(rewrite->window, window, length * sizeof(uint16_t)) == 0) {
+            return rewrite;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+static void insert_rewrite(RewriteTable* table, const Rewrite* rewrite) {
+    Rewrite* known = find_rewrite(table, rewrite->window, rewrite->length);
+    if (known != NULL) {
+        *known = *rewrite;
+        return;
+    }
+
+    // Keep the load factor below 3/4
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        Rewrite* old_slots = table->slots;
+        uint32_t old_capacity = table->capacity;
+        table->capacity *= 2;
+        table->slots = calloc(table->capacity, sizeof(Rewrite));
+        table->count = 0;
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old_slots[i].length != 0) {
+                insert_rewrite(table, &old_slots[i]);
+            }
+        }
+        free(old_slots);
+    }
+
+    uint32_t index = hash_bytes(rewrite->window, rewrite->length * sizeof(uint16_t)) & (table->capacity - 1);
+    while (table->slots[index].length != 0) {
+        index = (index + 1) & (table->capacity - 1);
+    }
+    table->slots[index] = *rewrite;
+    table->count++;
+}
+
+// "window = rewrite", malformed lines are ignored
+static void parse_rewrite_line(RewriteTable* table, char* line) {
+    Rewrite rewrite;
+    memset(&rewrite, 0, sizeof(Rewrite));
+    bool after_separator = false;
+
+    char* cursor = line;
+    for (;;) {
+        while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r') {
+            cursor++;
+        }
+        if (*cursor == '\0') {
+            break;
+        }
+        if (*cursor == '=' && !after_separator) {
+            after_separator = true;
+            cursor++;
+            continue;
+        }
+
+        char* end;
+        unsigned long value = strtoul(cursor, &end, 16);
+        if (end == cursor || value > 0xFFFF) {
+            return;
+        }
+        cursor = end;
+
+        if (!after_separator && rewrite.length < SUPEROPT_MAX_WINDOW) {
+            rewrite.window[rewrite.length++] = (uint16_t)value;
+        }
+        else if (after_separator && rewrite.rewrite_length < SUPEROPT_MAX_WINDOW) {
+            rewrite.rewrite[rewrite.rewrite_length++] = (uint16_t)value;
+        }
+        else {
+            return;
+        }
+    }
+
+    if (after_separator && rewrite.length > 0 && rewrite.rewrite_length <= rewrite.length) {
+        insert_rewrite(table, &rewrite);
+    }
+}
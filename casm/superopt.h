@@ -0,0 +1,41 @@
+#ifndef SUPEROPT_H
+#define SUPEROPT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+* Superoptimizer for straight-line register arithmetic (6xkk, 7xkk, 8xy0 - 8xy7, 8xyE).
+* A window of such instructions is replaced by the shortest sequence an exhaustive
+* search finds that leaves V0 - VF in the same state. The search only combines the
+* registers of the window with constants derived from it. Matches are checked on
+* edge case and random register states, under the VF semantics of modern
+* interpreters and of the COSMAC VIP (logic ops clear VF, shifts read VY).
+*
+* Results, including "nothing shorter", are stored in a text rewrite table that is
+* reused across builds:
+*
+*   casm superopt 1
+*   6005 7003 = 6008          window = rewrite, hex opcodes
+*/
+
+#define SUPEROPT_MAX_WINDOW 6       // instructions per window
+#define SUPEROPT_MAX_REWRITE 3      // longest sequence the search tries
+
+typedef struct RewriteTable RewriteTable;
+
+// Loads the table at path. A missing or outdated file gives an empty table.
+RewriteTable* load_rewrite_table(const char* path);
+// Writes the table back to its file if it gained entries
+bool save_rewrite_table(RewriteTable* table);
+void free_rewrite_table(RewriteTable* table);
+
+// Instructions that may be part of a window
+bool is_superopt_candidate(uint16_t opcode);
+
+// Stores the shortest sequence equivalent to window in rewrite and returns its
+// length, which is length if nothing shorter exists. searched is set if the table
+// had no usable entry for the window.
+int superoptimize(RewriteTable* table, const uint16_t* window, int length, uint16_t* rewrite, bool* searched);
+
+#endif // !SUPEROPT_H
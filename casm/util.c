@@ -0,0 +1,185 @@
+#if defined(_MSC_VER) || defined(__STDC_LIB_EXT1__)
+#define _CRT_SECURE_NO_WARNINGS
+#pragma warning(disable: 4996)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "util.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#define FNV_OFFSET_BASIS64 14695981039346656037ull
+#define FNV_PRIME64 1099511628211ull
+
+uint32_t hash_bytes(const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+uint32_t hash_string(const char* str) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+    while (*str != '\0') {
+        hash ^= (uint8_t)*str++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t hash_bytes64(const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    uint64_t hash = FNV_OFFSET_BASIS64;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME64;
+    }
+    return hash;
+}
+
+char* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length < 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    char* buffer = malloc(length + 1);
+    size_t read = fread(buffer, 1, length, file);
+    fclose(file);
+
+    if (read != (size_t)length) {
+        free(buffer);
+        return NULL;
+    }
+
+    buffer[length] = '\0';
+    if (size != NULL) {
+        *size = (size_t)length;
+    }
+    return buffer;
+}
+
+bool write_file(const char* path, const void* data, size_t size) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    size_t written = fwrite(data, 1, size, file);
+    fclose(file);
+    return written == size;
+}
+
+bool write_file_atomic(const char* path, const void* data, size_t size) {
+    char* temp_path = malloc(strlen(path) + 5);
+    strcpy(temp_path, path);
+    strcat(temp_path, ".tmp");
+
+    bool success = write_file(temp_path, data, size);
+#if defined(_WIN32)
+    success = success && MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    success = success && rename(temp_path, path) == 0;
+#endif
+    if (!success) {
+        remove(temp_path);
+    }
+
+    free(temp_path);
+    return success;
+}
+
+#if defined(_WIN32)
+
+const void* map_file(const char* path, size_t* size) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    LARGE_INTEGER length;
+    if (!GetFileSizeEx(file, &length) || length.QuadPart == 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return NULL;
+    }
+
+    // The view keeps the mapping alive
+    const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (data != NULL) {
+        *size = (size_t)length.QuadPart;
+    }
+    return data;
+}
+
+void unmap_file(const void* data, size_t size) {
+    UnmapViewOfFile(data);
+}
+
+bool make_directory(const char* path) {
+    return _mkdir(path) == 0 || errno == EEXIST;
+}
+
+#else
+
+const void* map_file(const char* path, size_t* size) {
+    int file = open(path, O_RDONLY);
+    if (file == -1) {
+        return NULL;
+    }
+
+    struct stat status;
+    if (fstat(file, &status) != 0 || status.st_size == 0) {
+        close(file);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = (size_t)status.st_size;
+    return data;
+}
+
+void unmap_file(const void* data, size_t size) {
+    munmap((void*)data, size);
+}
+
+bool make_directory(const char* path) {
+    return mkdir(path, 0777) == 0 || errno == EEXIST;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// FNV-1a, used for symbol lookup and for content hashes of source files
+uint32_t hash_bytes(const void* data, size_t length);
+uint32_t hash_string(const char* str);
+uint64_t hash_bytes64(const void* data, size_t length);
+
+// Reads a whole file into a null terminated buffer. Returns NULL on failure.
+char* read_file(const char* path, size_t* size);
+bool write_file(const char* path, const void* data, size_t size);
+
+// Writes to a temporary file next to path and renames it over path, so readers
+// never see a partially written file.
+bool write_file_atomic(const char* path, const void* data, size_t size);
+
+// Maps a whole file read only. Returns NULL on failure or for empty files.
+const void* map_file(const char* path, size_t* size);
+void unmap_file(const void* data, size_t size);
+
+// Creates a directory, succeeds if it already exists
+bool make_directory(const char* path);
+
+#endif // !UTIL_H
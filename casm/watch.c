@@ -0,0 +1,230 @@
+#if defined(_MSC_VER) || defined(__STDC_LIB_EXT1__)
+#define _CRT_SECURE_NO_WARNINGS
+#pragma warning(disable: 4996)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#else
+#include <sys/stat.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+#endif
+
+#include "watch.h"
+#include "diagnostics.h"
+
+// Quiet time after the last change before a burst of writes counts as finished
+#define DEBOUNCE_MS 15
+
+#if defined(__linux__)
+
+// The directories of the files are watched instead of the files themselves, editors
+// often save by writing a new file and renaming it over the old one.
+struct Watcher {
+    int fd;
+    int path_count;
+    int* directory_watches;     // watch descriptor of the directory of each path
+    const char** names;         // file name part of each path
+};
+
+static int watch_directory(Watcher* watcher, const char* path);
+static bool read_events(Watcher* watcher, bool* changed, bool* any);
+
+Watcher* create_watcher(char** paths, int path_count) {
+    Watcher* watcher = calloc(1, sizeof(Watcher));
+    watcher->fd = inotify_init1(IN_CLOEXEC);
+    watcher->path_count = path_count;
+    watcher->directory_watches = malloc(path_count * sizeof(int));
+    watcher->names = malloc(path_count * sizeof(char*));
+
+    if (watcher->fd == -1) {
+        free_watcher(watcher);
+        return NULL;
+    }
+
+    for (int i = 0; i < path_count; i++) {
+        const char* separator = strrchr(paths[i], '/');
+        watcher->names[i] = separator != NULL ? separator + 1 : paths[i];
+        watcher->directory_watches[i] = watch_directory(watcher, paths[i]);
+        if (watcher->directory_watches[i] == -1) {
+            report(SEVERITY_ERROR, DIAGNOSTIC_IO, NULL, 0, 0, "cannot watch '%s'", paths[i]);
+            free_watcher(watcher);
+            return NULL;
+        }
+    }
+    return watcher;
+}
+
+bool wait_for_changes(Watcher* watcher, bool* changed) {
+    memset(changed, 0, watcher->path_count * sizeof(bool));
+
+    // Block until the first relevant event, then until the writes settle
+    bool any = false;
+    int timeout = -1;
+    for (;;) {
+        struct pollfd descriptor = { watcher->fd, POLLIN, 0 };
+        int ready = poll(&descriptor, 1, timeout);
+        if (ready == -1) {
+            return false;
+        }
+        if (ready == 0) {
+            return true;
+        }
+        if (!read_events(watcher, changed, &any)) {
+            return false;
+        }
+        if (any) {
+            timeout = DEBOUNCE_MS;
+        }
+    }
+}
+
+void free_watcher(Watcher* watcher) {
+    if (watcher->fd != -1) {
+        close(watcher->fd);
+    }
+    free(watcher->directory_watches);
+    free(watcher->names);
+    free(watcher);
+}
+
+static int watch_directory(Watcher* watcher, const char* path) {
+    const char* separator = strrchr(path, '/');
+    if (separator == NULL) {
+        return inotify_add_watch(watcher->fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    }
+
+    size_t length = separator == path ? 1 : (size_t)(separator - path);
+    char* directory = malloc(length + 1);
+    memcpy(directory, path, length);
+    directory[length] = '\0';
+
+    int watch = inotify_add_watch(watcher->fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    free(directory);
+    return watch;
+}
+
+// Reads the pending events without blocking and flags the paths they refer to
+static bool read_events(Watcher* watcher, bool* changed, bool* any) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        struct pollfd descriptor = { watcher->fd, POLLIN, 0 };
+        int ready = poll(&descriptor, 1, 0);
+        if (ready <= 0) {
+            return ready == 0;
+        }
+
+        ssize_t length = read(watcher->fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            return false;
+        }
+
+        for (char* cursor = buffer; cursor < buffer + length;) {
+            const struct inotify_event* event = (const struct inotify_event*)cursor;
+            for (int i = 0; i < watcher->path_count && event->len > 0; i++) {
+                if (event->wd == watcher->directory_watches[i] && strcmp(event->name, watcher->names[i]) == 0) {
+                    changed[i] = true;
+                    *any = true;
+                }
+            }
+            cursor += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+#else
+
+#define POLL_INTERVAL_MS 50
+
+struct Watcher {
+    char** paths;
+    int path_count;
+    time_t* modified;
+    long long* sizes;
+};
+
+static void read_status(const char* path, time_t* modified, long long* size);
+static bool poll_changes(Watcher* watcher, bool* changed);
+static void sleep_ms(int milliseconds);
+
+Watcher* create_watcher(char** paths, int path_count) {
+    Watcher* watcher = calloc(1, sizeof(Watcher));
+    watcher->paths = paths;
+    watcher->path_count = path_count;
+    watcher->modified = malloc(path_count * sizeof(time_t));
+    watcher->sizes = malloc(path_count * sizeof(long long));
+    for (int i = 0; i < path_count; i++) {
+        read_status(paths[i], &watcher->modified[i], &watcher->sizes[i]);
+    }
+    return watcher;
+}
+
+bool wait_for_changes(Watcher* watcher, bool* changed) {
+    memset(changed, 0, watcher->path_count * sizeof(bool));
+
+    while (!poll_changes(watcher, changed)) {
+        sleep_ms(POLL_INTERVAL_MS);
+    }
+
+    // Collect changes until the writes settle
+    do {
+        sleep_ms(DEBOUNCE_MS);
+    } while (poll_changes(watcher, changed));
+
+    return true;
+}
+
+void free_watcher(Watcher* watcher) {
+    free(watcher->modified);
+    free(watcher->sizes);
+    free(watcher);
+}
+
+static void read_status(const char* path, time_t* modified, long long* size) {
+    struct stat status;
+    if (stat(path, &status) == 0) {
+        *modified = status.st_mtime;
+        *size = (long long)status.st_size;
+    }
+    else {
+        *modified = 0;
+        *size = -1;
+    }
+}
+
+static bool poll_changes(Watcher* watcher, bool* changed) {
+    bool any = false;
+    for (int i = 0; i < watcher->path_count; i++) {
+        time_t modified;
+        long long size;
+        read_status(watcher->paths[i], &modified, &size);
+        if (modified != watcher->modified[i] || size != watcher->sizes[i]) {
+            watcher->modified[i] = modified;
+            watcher->sizes[i] = size;
+            changed[i] = true;
+            any = true;
+        }
+    }
+    return any;
+}
+
+static void sleep_ms(int milliseconds) {
+#if defined(_WIN32)
+    Sleep(milliseconds);
+#else
+    struct timespec duration = { milliseconds / 1000, (milliseconds % 1000) * 1000000L };
+    nanosleep(&duration, NULL);
+#endif
+}
+
+#endif
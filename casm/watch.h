@@ -0,0 +1,17 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+
+// File change notification for --watch. Uses inotify on Linux and polls the
+// modification time elsewhere.
+typedef struct Watcher Watcher;
+
+Watcher* create_watcher(char** paths, int path_count);
+// Blocks until at least one path changed and no further change arrived for the
+// debounce interval. changed[i] is set for every path that changed.
+// Returns false if watching failed.
+bool wait_for_changes(Watcher* watcher, bool* changed);
+void free_watcher(Watcher* watcher);
+
+#endif // !WATCH_H
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Regression tests. Builds casm, runs every case in cases.txt from tests/src and
+# compares its outputs with the files of the same name in tests/expected.
+#
+#   tests/run.sh             run all cases
+#   tests/run.sh --update    replace the expected files with the current outputs
+#
+# cases.txt holds one casm invocation per line, "name: arguments", run from tests/src.
+# In the arguments @ stands for ../out/name, so "x: x.asm -o @.ch8" writes
+# tests/out/x.ch8. Lines of the same name run in order and append to one name.out
+# (output and exit status).
+# CC selects the compiler, CFLAGS is passed to it.
+
+tests=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$tests")
+out="$tests/out"
+update=0
+if [ "${1:-}" = "--update" ]; then
+    update=1
+fi
+
+rm -rf "$out"
+mkdir -p "$out"
+${CC:-cc} -std=c11 ${CFLAGS:--O1} -o "$out/casm" "$root"/casm/*.c || exit 1
+
+cd "$tests/src" || exit 1
+while IFS= read -r line; do
+    case "$line" in
+        ""|"#"*) continue ;;
+    esac
+    name=${line%%:*}
+    arguments=$(printf '%s' "${line#*:}" | sed "s|@|../out/$name|g")
+    # Word splitting of the arguments is intended
+    "$out/casm" $arguments >> "$out/$name.out" 2>&1
+    echo "exit $?" >> "$out/$name.out"
+done < "$tests/cases.txt"
+
+failed=0
+total=0
+for result in "$out"/*.out; do
+    name=$(basename "$result" .out)
+    total=$((total + 1))
+    if [ $update -eq 1 ]; then
+        rm -f "$tests/expected/$name".*
+        for file in "$out/$name".out "$out/$name".ch8 "$out/$name".dbg "$out/$name".tbl; do
+            if [ -f "$file" ]; then
+                cp "$file" "$tests/expected/"
+            fi
+        done
+        continue
+    fi
+    for expected in "$tests/expected/$name".*; do
+        actual="$out/$(basename "$expected")"
+        if ! cmp -s "$expected" "$actual"; then
+            echo "FAIL $name: $(basename "$expected") differs"
+            failed=$((failed + 1))
+            break
+        fi
+    done
+done
+
+if [ $update -eq 1 ]; then
+    echo "updated $total case(s)"
+    exit 0
+fi
+echo "$((total - failed)) of $total case(s) passed"
+[ $failed -eq 0 ]
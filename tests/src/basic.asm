@@ -0,0 +1,37 @@
+start:
+    CLS
+    LD V0, 1
+    LD VA, 0x2F
+    ADD VB, 3
+    SE VC, 4
+    SE VD, VE
+    SNE V3, 7
+    SNE V1, V2
+    LD VF, V9
+    OR V1, V2
+    AND V3, V4
+    XOR V5, V6
+    ADD V7, V8
+    SUB V9, VA
+    SHR VB
+    SUBN VC, VD
+    SHL VE
+    LD I, start
+    JP V0, start
+    LD V4, DT
+    LD V5, K
+    LD DT, V6
+    LD ST, V7
+    ADD I, V8
+    LD F, V9
+    RND V4, 0xFF
+    DRW V5, V6, 3
+    LD B, VA
+    LD [I], VB
+    LD VC, [I]
+    SKP VD
+    SKNP VE
+    CALL sub
+    JP start
+sub:
+    RET
@@ -0,0 +1,7 @@
+start:
+    LD I, a
+    JP start
+a:
+    DB 1, 2
+b:
+    DB 1, 2
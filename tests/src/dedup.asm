@@ -0,0 +1,23 @@
+ZERO EQU 0
+    LD I, a
+    LD I, b
+    LD I, c
+    LD I, d
+    LD I, e
+    LD I, tail
+    LD I, f
+    JP after
+a:  DB 1, 2, 3
+b:  DB 9, 9, 1, 2, 3
+c:  DB 1, 2, ZERO + 3
+d:  DB 2, 3
+f:  DB $ & 0xFF
+e:  DB 2, 3
+tail:
+after:
+    LD I, g
+    JP after
+SECTION data
+g:  DB 9, 9
+    DB 1, 2
+h:  DB 3
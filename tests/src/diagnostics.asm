@@ -0,0 +1,9 @@
+start:
+    LD V0, 1
+    LD VG, 2
+    FOO V1
+    LD V1, 300
+    JP missing
+    LD V2, 1 +
+    ADD V1 V2 V3
+    JP start
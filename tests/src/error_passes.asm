@@ -0,0 +1,5 @@
+    JP nowhere
+    CLS
+x:
+    CLS
+x:
@@ -0,0 +1,5 @@
+    LD V0, 1 << 40
+    LD V1, 0x80 >> -1
+    LD V2, 99999999999999999999
+    LD V3, 0x10000000000000000 >> 60
+    LD V4, 1 << 31 >> 28
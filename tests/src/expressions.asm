@@ -0,0 +1,18 @@
+WIDTH EQU 64
+DEFINE HEIGHT 32
+    LD V0, 1 + 2 * 3
+    LD V1, (1 + 2) * 3
+    LD V2, 1 << 2 + 1
+    LD V3, 0xF0 | 0x0F & 0x3C
+    LD V4, 0x0F ^ 0xFF & 0xF0
+    LD V5, 100 / 7 % 5
+    LD V6, -1
+    LD V7, ~0x0F & 0xFF
+    LD V8, (WIDTH - 8) / 2
+    LD V9, HIGH(table) & 0x0F
+    LD VA, LOW(table)
+    LD VB, HEIGHT * 2 - 0b101
+    LD I, table + 2
+    JP $
+table:
+    DW 0x1234, $
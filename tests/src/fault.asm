@@ -0,0 +1,5 @@
+start:
+    LD V0, 1
+bad:
+    LD V1, 2
+    DW 0xF0FF
@@ -0,0 +1,5 @@
+GLOBAL start, missing
+GLOBAL WIDTH
+WIDTH EQU 4
+start:
+    JP start
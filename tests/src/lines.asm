@@ -0,0 +1,8 @@
+start:
+
+	LD V0, 1
+	FOO
+    LD V1, 2
+
+    JP start
+    BAR
@@ -0,0 +1,3 @@
+GLOBAL table
+SECTION d
+table: DW start, table
@@ -0,0 +1,4 @@
+GLOBAL start
+start:
+    LD I, table
+    JP start
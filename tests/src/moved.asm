@@ -0,0 +1,23 @@
+start:
+    LD V0, 1
+    ADD V0, 1
+    ADD V0, 1
+    LD I, start+6
+    JP start+8
+    JP V0, adds
+    CALL 0x20C
+    LD I, sprite+1
+    LD I, 0x050
+    JP start
+adds:
+    ADD V1, 1
+    ADD V1, 1
+    ADD V1, 1
+    RET
+sprite:
+    DB 1, 2
+copy:
+    DB 1, 2
+after:
+    DB 3
+    LD I, copy+2
@@ -0,0 +1,5 @@
+ORG 0x300
+CLS
+CLS
+ORG 0x302
+CLS
@@ -0,0 +1,16 @@
+ROWS EQU 3
+start:
+REPT ROWS, row
+  LD V0, row * 8
+  REPT 2, col
+    LD V1, row + col
+  ENDR
+  OFF EQU row*2
+  LD V2, OFF
+ENDR
+LD I, end
+REPT 0
+ CLS
+ENDR
+end:
+JP start
@@ -0,0 +1,10 @@
+REPT 2, i
+    LD V0, i
+ENDR
+REPT 3, i
+loop:
+    ADD V0, i
+    SE V0, 0
+    JP loop
+ENDR
+    LD V1, i
@@ -0,0 +1,7 @@
+    RND V0, 0x3F
+    RND V1, 0x1F
+    RND V2, 0x0F
+    LD F, V2
+    DRW V0, V1, 5
+loop:
+    JP loop
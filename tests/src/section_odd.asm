@@ -0,0 +1,6 @@
+    CLS
+SECTION text
+    DB 1
+    CLS
+    DB 2, 3
+    RET
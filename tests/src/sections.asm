@@ -0,0 +1,14 @@
+    JP main
+SECTION gfx
+player:
+    DB 0x3C, 0x7E, 0xFF, 0x7E, 0x3C
+pointers:
+    DW player, main
+SECTION code2
+sub:
+    RET
+ORG 0x400
+main:
+    LD I, player
+    CALL sub
+    JP main
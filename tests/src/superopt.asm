@@ -0,0 +1,18 @@
+start:
+    LD V0, 5
+    ADD V0, 3
+    LD V1, V0
+    ADD V1, 0
+    LD V2, V2
+    ADD V3, 1
+    ADD V3, 1
+    ADD V3, 1
+loop:
+    SE V0, 8
+    ADD V4, 1
+    ADD V4, 1
+    LD V5, V4
+    XOR V5, V5
+    ADD V5, V6
+    SHL V6
+    JP loop
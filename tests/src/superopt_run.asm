@@ -0,0 +1,50 @@
+    RND V0, 0xFF
+    RND V1, 0xFF
+    RND V2, 0xFF
+    RND V3, 0xFF
+    RND V4, 0xFF
+    RND V5, 0xFF
+    RND V6, 0xFF
+    RND V7, 0xFF
+    RND V8, 0xFF
+    RND V9, 0xFF
+    RND VA, 0xFF
+    RND VB, 0xFF
+    RND VC, 0xFF
+    RND VD, 0xFF
+    RND VE, 0xFF
+    RND VF, 0xFF
+w0:
+    ADD V6, 93
+    SUB V2, V2
+    AND VF, V2
+    LD V6, V6
+    LD VF, VF
+    SUB VF, V2
+w1:
+    LD V2, 3
+w2:
+    SUBN VB, VF
+    LD V2, 0
+w3:
+    LD V2, 128
+    AND V6, VB
+    SUB VF, VB
+    SUBN VF, VB
+    ADD V2, 255
+    LD V2, 128
+    AND V2, V6
+    LD I, buf
+    LD [I], VF
+    LD VE, 0
+    LD VD, 0
+    DRW VE, VD, 15
+    LD I, buf2
+    LD VE, 10
+    DRW VE, VD, 1
+end:
+    JP end
+buf:
+    DB 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+buf2:
+    DB 0
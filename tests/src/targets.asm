@@ -0,0 +1,10 @@
+    SCD 4
+    DRW V1, V2, 0
+    SCR
+    SCL
+    LOW
+    HIGH
+    LD HF, V1
+    LD R, V2
+    LD V3, R
+    EXIT
@@ -0,0 +1,11 @@
+    SCU 2
+    SAVE V1, V4
+    LOAD V2, V3
+    PLANE 3
+    AUDIO
+    PITCH V5
+    LD I, LONG far
+    JP 0x200
+ORG 0x1200
+far:
+    DB 0xAA